@@ -1,6 +1,9 @@
 #define _USE_MATH_DEFINES
 #include "raster_tools.h"
+#include "render_context.h"
 #include <iostream>
+#include <thread>
+#include <string.h>
 #include "math.h"
 
 using namespace std;
@@ -17,112 +20,110 @@ int main(int argc, char *argv[])
         int w = atoi(argv[3]);
         int h = atoi(argv[4]);
         char *out_file = argv[5];
-        char *opt;
-        if(argc==7){
-            opt = argv[6];
+        char *opt = NULL;
+
+        // Use every core unless the number of threads is given with --threads N
+        int threads = max(1, (int)thread::hardware_concurrency());
+
+        // Load the OBJ from its binary mesh cache (written on the first load) unless --no-cache is given
+        bool use_cache = true;
+
+        // Keep the whole mesh in memory unless a budget is given with --max-memory MB, in which case it is streamed in batches
+        size_t max_memory = 0;
+
+        // Keep the triangles facing either way unless --cull back or --cull front is given. --stats prints the counters of the render.
+        cull_mode cull = CULL_NONE;
+        bool show_stats = false;
+
+        // Draw the triangles in file order unless --sort is given, which draws them front to back
+        bool sort = false;
+
+        // Shade while rasterizing unless --prepass is given, which draws the depths first and then shades each visible pixel once
+        bool prepass = false;
+
+        // Shade each visible pixel once after rasterizing a visibility buffer with --deferred
+        bool deferred = false;
+
+        // One sample per pixel unless --msaa 2, 4 or 8 is given, which multisamples the edges
+        int msaa = 1;
+
+        // Only the pixel centers are sampled unless --adaptive T is given, which draws the pixels on the edges again with
+        // several samples each. Pixels differing from a neighbour by more than T (0 to 1) in color or relative depth are refined.
+        bool adaptive = false;
+        float adaptive_threshold = ADAPTIVE_THRESHOLD;
+
+        // The remaining arguments are the shading option and the other options (in any order)
+        for(int i = 6; i < argc; i++){
+            if((strcmp(argv[i], "--threads") == 0) && (i + 1 < argc)){
+                threads = max(1, atoi(argv[++i]));
+            }
+            else if(strcmp(argv[i], "--no-cache") == 0){
+                use_cache = false;
+            }
+            else if((strcmp(argv[i], "--max-memory") == 0) && (i + 1 < argc)){
+                max_memory = (size_t)max(1, atoi(argv[++i])) * 1024 * 1024;
+            }
+            else if((strcmp(argv[i], "--cull") == 0) && (i + 1 < argc)){
+                i++;
+                if(strcmp(argv[i], "back") == 0) cull = CULL_BACK;
+                else if(strcmp(argv[i], "front") == 0) cull = CULL_FRONT;
+                else if(strcmp(argv[i], "none") == 0) cull = CULL_NONE;
+                else{
+                    cerr << "Unknown culling mode [" << argv[i] << "] (use none, back or front)" << endl;
+                    return 1;
+                }
+            }
+            else if(strcmp(argv[i], "--stats") == 0){
+                show_stats = true;
+            }
+            else if(strcmp(argv[i], "--sort") == 0){
+                sort = true;
+            }
+            else if(strcmp(argv[i], "--prepass") == 0){
+                prepass = true;
+            }
+            else if(strcmp(argv[i], "--deferred") == 0){
+                deferred = true;
+            }
+            else if((strcmp(argv[i], "--msaa") == 0) && (i + 1 < argc)){
+                msaa = atoi(argv[++i]);
+            }
+            else if((strcmp(argv[i], "--adaptive") == 0) && (i + 1 < argc)){
+                adaptive = true;
+                adaptive_threshold = (float)atof(argv[++i]);
+            }
+            else{
+                opt = argv[i];
+            }
         }
-        else{
-            opt = NULL;
-        }
-
-    // Load object and see contents
-    vector<tinyobj::shape_t> shapes;
-    vector<tinyobj::material_t> materials;
-    string temp_str = LoadObj( shapes, materials, obj_file);
-
-    // Load camera parameters and estimate the entire perspective matrix to convert from world to camera pixel coordinates (& Z (in [0,1]))
-    cam_dat cam = get_permat(cam_file);
-
-    // Make vectors to store homogeneous coordinates and normal data so that they can be accessed later using indices
-    vector <vector <vec4>> homo_coord;
-    vector <vector <vec4>> normals;
-
-    // Setting temporary containers
-    vec4 temp;
-    vector <vec4> temp_coord;
-    vector <vec4> temp_norm;
-
-    // Loop to store data
-    for(unsigned int j = 0; j < shapes.size(); j++){
-
-        for(unsigned int i = 0; i < shapes[j].mesh.positions.size(); i += 3){
-
-            temp = vec4(shapes[j].mesh.positions[i], shapes[j].mesh.positions[i+1], shapes[j].mesh.positions[i+2], 1);
-            temp = cam.per_mat * temp;
-
-            //Convert to homogeneous coordinates (NDC)
-            temp /= temp[3];
-
-            // Convert NDC to pixel coordinates
-            temp[0] = (float)((temp[0] + 1) * ((float) w) / 2.0);
-            temp[1] = (float)((1 - temp[1]) * ((float) h) / 2.0);
-            temp[3] = i/3;
-            temp_coord.push_back(temp);
-
-            // Rotate the normals to the camera frame
-            temp = cam.rot_mat * vec4(shapes[j].mesh.normals[i], shapes[j].mesh.normals[i+1], shapes[j].mesh.normals[i+2], 1);
-            temp[3] = i/3;
-            temp_norm.push_back(temp);
-
-        }
-
-        homo_coord.push_back(temp_coord);
-        normals.push_back(temp_norm);
-
-    }
-
-
-    // Container to store face information (vertex coordinates and normals)
-    vector< vector <face> > pix_triangles;
-
-    // Loop to store face data
-    for(unsigned int i = 0; i < shapes.size(); i++){
-
-        vector <face> shape_triangles = world_to_im(shapes[i], homo_coord[i], normals[i]);
-//        cout<<shapes[0].mesh.positions.size()<<endl<<shape_triangles.size()<<endl;
-        pix_triangles.push_back(shape_triangles);
 
+    // The render context owns the mesh, the buffers and the threads
+    RenderContext ctx(threads, use_cache, max_memory);
+    ctx.set_cull(cull);
+    ctx.set_sort(sort);
+    ctx.set_prepass(prepass);
+    ctx.set_deferred(deferred);
+    if(!ctx.set_msaa(msaa)){
+        cerr << "Unsupported number of samples [" << msaa << "] for --msaa (use 2, 4 or 8)" << endl;
+        return 1;
     }
+    ctx.set_adaptive(adaptive, adaptive_threshold);
 
-    // Calculate the bounding boxes for each triangle using the vertex info
-    vector< vector <bbox> > bboxes;
-
-    // Loop to store bounding box data
-    for(unsigned int i = 0; i < shapes.size(); i++){
-
-        vector <bbox> bbox_temp = get_bbox(pix_triangles[i], w , h);
-//        for(bbox i: bbox_temp){cout<<i.x<<" "<<i.y<<" "<<i.w<<" "<<i.h<<endl;}
-        bboxes.push_back(bbox_temp);
-
-    }
+    // Load object (or its binary cache) and see contents
+    ctx.load(obj_file);
 
-    // Scan along each row and find left and right edge intersections.
-    // Apply checks and check for special cases and arrive at 1 (when just touching) or 2 coordinates (when passing thru triangle)
-    vector <vector <corn_pts>> corner_pts;
-
-    // Loop through to find the intersection points for each face (triangle)
-    for(unsigned int i = 0; i < shapes.size(); i++){
-        vector <corn_pts> cpts_temp = get_corners(pix_triangles[i], bboxes[i]);
-        corner_pts.push_back(cpts_temp);
-    }
+    // Load camera parameters and estimate the entire perspective matrix to convert from world to camera pixel coordinates (& Z (in [0,1]))
+    cam_dat cam = get_permat(cam_file);
 
-    // Initialize the image
-    img_t *img = new_img(w,h);
+    // Project the mesh and fill the image depending on the option chosen
+    img_t *img = ctx.render(cam, w, h, opt);
 
-    // Set container for Z-buffer. Initialize all values to 2.
-    vector <float> z_info((w*h),2.0);
+    // Store the image generated in a file (the image itself is freed by the context)
+    write_ppm(img, out_file);
 
-    // Loop to fill the image using face data, corner intersection data and other data depending on the option chosen.
-    for(unsigned int i = 0; i < shapes.size(); i++){
-        img = fill_img(img, pix_triangles[i],corner_pts[i], materials[i],z_info,homo_coord[i],
-                       normals[i], opt);
+    if(show_stats){
+        print_stats(ctx.last_stats());
     }
 
-    // Store the image generated in a file
-    write_ppm(img, out_file);
-    destroy_img(&img);
-
-    // Destroy the image
     return 0;
 }
-
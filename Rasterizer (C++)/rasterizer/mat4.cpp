@@ -1,6 +1,9 @@
 #include "mat4.h"
 #include <assert.h>
 #include "math.h"
+#if !defined(VEC4_SCALAR) && defined(__AVX__)
+#include <immintrin.h>
+#endif
 
 # define M_PI           3.14159265358979323846
 
@@ -213,10 +216,25 @@ mat4 mat4::operator/(float c) const{// division by a scalar
 /// Matrix multiplication (m1 * m2)
 mat4 mat4::operator*(const mat4 &m2) const{
     mat4 result;
+#if !defined(VEC4_SCALAR) && defined(__AVX__)
+    // Two result columns at a time: each 8 wide register holds a column of this matrix twice
+    // and is scaled by the matching entries of two columns of m2.
+    for(int i=0; i<4; i+=2){
+        __m256 sum = _mm256_setzero_ps();
+        for(int k=0; k<4; k++){
+            __m256 col = _mm256_broadcast_ps((const __m128 *)data[k].data);
+            __m256 c = _mm256_setr_m128(_mm_set1_ps(m2.data[i].data[k]), _mm_set1_ps(m2.data[i+1].data[k]));
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(col, c));
+        }
+        _mm_store_ps(result.data[i].data, _mm256_castps256_ps128(sum));
+        _mm_store_ps(result.data[i+1].data, _mm256_extractf128_ps(sum, 1));
+    }
+#else
     // Using the matrix by column multiplication for each column in the 2nd matrix to find the columns in result matrix
     for(int i=0; i<4; i++){
         result[i] = (*this)*m2[i];
     }
+#endif
     return result;
 }
 
@@ -224,11 +242,21 @@ mat4 mat4::operator*(const mat4 &m2) const{
 /// Assume v is a column vector (ie. a 4x1 matrix)
 vec4 mat4::operator*(const vec4 &v) const{
     vec4 result;
+#ifdef VEC4_SCALAR
     // Finding the dot product of each row of the matrix with the column vector
     for(int i=0; i<4; i++){
         vec4 row_i(data[0][i],data[1][i],data[2][i],data[3][i]);
         result[i] = dot(row_i,v);
     }
+#else
+    // Sum of the columns of the matrix scaled by the elements of the vector.
+    // The sums are done in the same order as the dot products above.
+    __m128 sum = _mm_mul_ps(_mm_load_ps(data[0].data), _mm_set1_ps(v.data[0]));
+    for(int k=1; k<4; k++){
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_load_ps(data[k].data), _mm_set1_ps(v.data[k])));
+    }
+    _mm_store_ps(result.data, sum);
+#endif
     return result;
 }
 
@@ -239,11 +267,24 @@ vec4 mat4::operator*(const vec4 &v) const{
 /// Returns the transpose of the input matrix (v_ij == v_ji)
 mat4 mat4::transpose() const{
     mat4 result;
+#ifdef VEC4_SCALAR
     // Set column of the result matrix using row data from the member variable
     for(int i=0; i<4; i++){
         vec4 row_i(data[0][i],data[1][i],data[2][i],data[3][i]);
         result[i] = row_i;
     }
+#else
+    // Shuffle the 4 columns into rows in registers
+    __m128 c0 = _mm_load_ps(data[0].data);
+    __m128 c1 = _mm_load_ps(data[1].data);
+    __m128 c2 = _mm_load_ps(data[2].data);
+    __m128 c3 = _mm_load_ps(data[3].data);
+    _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+    _mm_store_ps(result.data[0].data, c0);
+    _mm_store_ps(result.data[1].data, c1);
+    _mm_store_ps(result.data[2].data, c2);
+    _mm_store_ps(result.data[3].data, c3);
+#endif
     return result;
 }
 
@@ -0,0 +1,315 @@
+#include "mesh_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Round a file offset up to the section alignment
+static unsigned long long align_up(unsigned long long offset){
+    return (offset + MESH_CACHE_ALIGN - 1) / MESH_CACHE_ALIGN * MESH_CACHE_ALIGN;
+}
+
+// Check that a section of count elements of size bytes lies inside the file and is aligned for direct use
+static bool section_ok(unsigned long long offset, unsigned long long count, size_t size, size_t file_size){
+    if(count == 0) return true;
+    return (offset % MESH_CACHE_ALIGN == 0) && (offset <= file_size) && (count <= (file_size - offset) / size);
+}
+
+///----------------------------------------------------------------------
+/// Constructors
+///----------------------------------------------------------------------
+
+/// Create a cache with nothing mapped
+mesh_cache::mesh_cache() : data(NULL), size(0){
+}
+
+/// Unmap the file
+mesh_cache::~mesh_cache(){
+    close();
+}
+
+///----------------------------------------------------------------------
+/// Methods
+///----------------------------------------------------------------------
+
+// Record the size and modification time of a file, or that it does not exist
+static void stat_source(const char *path, unsigned long long &size, long long &mtime){
+    struct stat st;
+    if(stat(path, &st) != 0){
+        size = MESH_CACHE_MISSING;
+        mtime = 0;
+        return;
+    }
+    size = st.st_size;
+    mtime = st.st_mtime;
+}
+
+/// Map the cache of obj_file if it exists and was made from the current version of obj_file and of its .mtl files
+bool mesh_cache::open(const char *obj_file, vector<mesh_view> &meshes, vector<tinyobj::material_t> &materials){
+
+    close();
+
+    // The cache is only valid for the exact version of the OBJ file it was made from
+    struct stat src, st;
+    std::string path = mesh_cache_path(obj_file);
+    if(stat(obj_file, &src) != 0 || stat(path.c_str(), &st) != 0) return false;
+    if(st.st_size < (off_t)sizeof(mesh_cache_header)) return false;
+
+#ifndef _WIN32
+    // Map the whole file read only
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(p == MAP_FAILED) return false;
+#else
+    // No mmap here. Read the file into memory instead.
+    void *p = malloc(st.st_size);
+    FILE *f = fopen(path.c_str(), "rb");
+    if(f == NULL || fread(p, 1, st.st_size, f) != (size_t)st.st_size){
+        if(f != NULL) fclose(f);
+        free(p);
+        return false;
+    }
+    fclose(f);
+#endif
+    data = p;
+    size = st.st_size;
+
+    const char *base = (const char *)data;
+    const mesh_cache_header *h = (const mesh_cache_header *)base;
+
+    // Check the header against the OBJ file and the size of the cache file
+    if(memcmp(h->magic, MESH_CACHE_MAGIC, sizeof(h->magic)) != 0 ||
+       h->src_size != (unsigned long long)src.st_size || h->src_mtime != (long long)src.st_mtime ||
+       h->file_size != size ||
+       !section_ok(align_up(sizeof(mesh_cache_header)), h->n_shapes, sizeof(mesh_cache_shape), size)){
+        close();
+        return false;
+    }
+
+    const mesh_cache_shape *shape = (const mesh_cache_shape *)(base + align_up(sizeof(mesh_cache_header)));
+    unsigned long long mat_offset = align_up(sizeof(mesh_cache_header)) + align_up(h->n_shapes * sizeof(mesh_cache_shape));
+    if(!section_ok(mat_offset, h->n_materials, sizeof(mesh_cache_material), size)){
+        close();
+        return false;
+    }
+    const mesh_cache_material *mat = (const mesh_cache_material *)(base + mat_offset);
+
+    // The materials are only valid while the .mtl files they were read from are unchanged
+    unsigned long long mtl_offset = mat_offset + align_up(h->n_materials * sizeof(mesh_cache_material));
+    if(!section_ok(mtl_offset, h->n_mtl_files, sizeof(mesh_cache_source), size)){
+        close();
+        return false;
+    }
+    const mesh_cache_source *mtl = (const mesh_cache_source *)(base + mtl_offset);
+    for(unsigned int i = 0; i < h->n_mtl_files; i++){
+        unsigned long long mtl_size;
+        long long mtl_mtime;
+        if(memchr(mtl[i].path, 0, MESH_CACHE_PATH_MAX) == NULL){
+            close();
+            return false;
+        }
+        stat_source(mtl[i].path, mtl_size, mtl_mtime);
+        if(mtl_size != mtl[i].size || mtl_mtime != mtl[i].mtime){
+            close();
+            return false;
+        }
+    }
+
+    // Point the views straight into the mapping
+    meshes.resize(h->n_shapes);
+    for(unsigned int i = 0; i < h->n_shapes; i++){
+        const mesh_cache_shape &s = shape[i];
+        if(!section_ok(s.positions, s.n_positions, sizeof(float), size) ||
+           !section_ok(s.normals, s.n_normals, sizeof(float), size) ||
+           !section_ok(s.indices, s.n_indices, sizeof(unsigned int), size) ||
+           !section_ok(s.material_ids, s.n_material_ids, sizeof(int), size)){
+            meshes.clear();
+            close();
+            return false;
+        }
+        mesh_view &v = meshes[i];
+        v.n_verts = s.n_positions / 3;
+        v.n_indices = s.n_indices;
+        v.positions = (const float *)(base + s.positions);
+        v.normals = (s.n_normals == s.n_positions && s.n_normals > 0) ? (const float *)(base + s.normals) : NULL;
+        v.indices = (const unsigned int *)(base + s.indices);
+        v.material_ids = (s.n_material_ids > 0) ? (const int *)(base + s.material_ids) : NULL;
+    }
+
+    // Materials are small, copy them into the usual structure
+    materials.resize(h->n_materials);
+    for(unsigned int i = 0; i < h->n_materials; i++){
+        tinyobj::material_t &m = materials[i];
+        memcpy(m.ambient, mat[i].ambient, sizeof(m.ambient));
+        memcpy(m.diffuse, mat[i].diffuse, sizeof(m.diffuse));
+        memcpy(m.specular, mat[i].specular, sizeof(m.specular));
+        memcpy(m.transmittance, mat[i].transmittance, sizeof(m.transmittance));
+        memcpy(m.emission, mat[i].emission, sizeof(m.emission));
+        m.shininess = mat[i].shininess;
+        m.ior = mat[i].ior;
+        m.dissolve = mat[i].dissolve;
+        m.illum = mat[i].illum;
+    }
+
+    return true;
+}
+
+/// Unmap the file
+void mesh_cache::close(){
+    if(data == NULL) return;
+#ifndef _WIN32
+    munmap(data, size);
+#else
+    free(data);
+#endif
+    data = NULL;
+    size = 0;
+}
+
+///----------------------------------------------------------------------
+/// Other Functions (not part of the mesh_cache class)
+///----------------------------------------------------------------------
+
+// Path of the cache file of an OBJ file
+std::string mesh_cache_path(const char *obj_file){
+    return std::string(obj_file) + MESH_CACHE_EXT;
+}
+
+// Write count elements of size bytes at offset (padding the file up to offset with zeros)
+static bool write_section(FILE *f, unsigned long long &pos, unsigned long long offset, const void *src, size_t size, size_t count){
+    static const char zeros[MESH_CACHE_ALIGN] = {0};
+    while(pos < offset){
+        size_t pad = min((unsigned long long)MESH_CACHE_ALIGN, offset - pos);
+        if(fwrite(zeros, 1, pad, f) != pad) return false;
+        pos += pad;
+    }
+    if(count > 0 && fwrite(src, size, count, f) != count) return false;
+    pos = offset + (unsigned long long)size * count;
+    return true;
+}
+
+// Find the .mtl files an OBJ file reads its materials from, with the paths the OBJ loader opens them with
+static bool find_mtl_files(const char *obj_file, vector<mesh_cache_source> &mtl_files){
+    FILE *f = fopen(obj_file, "rb");
+    if(f == NULL) return false;
+
+    // Lines longer than the buffer are read in pieces, and only a piece starting a line can be an mtllib command
+    char line[4096];
+    bool line_start = true;
+    while(fgets(line, sizeof(line), f) != NULL){
+        bool at_start = line_start;
+        size_t len = strlen(line);
+        line_start = (len > 0) && (line[len - 1] == '\n');
+        if(!at_start) continue;
+
+        const char *p = line + strspn(line, " \t");
+        if(strncmp(p, "mtllib", 6) != 0 || (p[6] != ' ' && p[6] != '\t')) continue;
+        p += 7;
+        p += strspn(p, " \t");
+        size_t n = strcspn(p, "\r\n");
+        if(n == 0) continue;
+        if(n >= MESH_CACHE_PATH_MAX){
+            fclose(f);
+            return false;
+        }
+
+        mesh_cache_source s;
+        memset(&s, 0, sizeof(s));
+        memcpy(s.path, p, n);
+        stat_source(s.path, s.size, s.mtime);
+        mtl_files.push_back(s);
+    }
+    fclose(f);
+    return true;
+}
+
+// Write the cache file of obj_file from its parsed shapes and materials
+bool write_mesh_cache(const char *obj_file, vector<tinyobj::shape_t> &shapes, vector<tinyobj::material_t> &materials){
+
+    struct stat src;
+    if(stat(obj_file, &src) != 0) return false;
+    vector<mesh_cache_source> mtl_files;
+    if(!find_mtl_files(obj_file, mtl_files)) return false;
+
+    // Lay out the file: header, shape table, material table and then the data of every shape
+    mesh_cache_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MESH_CACHE_MAGIC, sizeof(h.magic));
+    h.src_size = src.st_size;
+    h.src_mtime = src.st_mtime;
+    h.n_shapes = shapes.size();
+    h.n_materials = materials.size();
+    h.n_mtl_files = mtl_files.size();
+
+    unsigned long long shape_offset = align_up(sizeof(mesh_cache_header));
+    unsigned long long mat_offset = shape_offset + align_up(shapes.size() * sizeof(mesh_cache_shape));
+    unsigned long long mtl_offset = mat_offset + align_up(materials.size() * sizeof(mesh_cache_material));
+    unsigned long long offset = mtl_offset + align_up(mtl_files.size() * sizeof(mesh_cache_source));
+
+    vector<mesh_cache_shape> table(shapes.size());
+    for(unsigned int i = 0; i < shapes.size(); i++){
+        tinyobj::mesh_t &m = shapes[i].mesh;
+        mesh_cache_shape &s = table[i];
+        s.positions = offset;
+        s.n_positions = m.positions.size();
+        offset = align_up(offset + s.n_positions * sizeof(float));
+        s.normals = offset;
+        s.n_normals = m.normals.size();
+        offset = align_up(offset + s.n_normals * sizeof(float));
+        s.indices = offset;
+        s.n_indices = m.indices.size();
+        offset = align_up(offset + s.n_indices * sizeof(unsigned int));
+        s.material_ids = offset;
+        s.n_material_ids = m.material_ids.size();
+        offset = align_up(offset + s.n_material_ids * sizeof(int));
+    }
+    h.file_size = offset;
+
+    vector<mesh_cache_material> mats(materials.size());
+    for(unsigned int i = 0; i < materials.size(); i++){
+        tinyobj::material_t &m = materials[i];
+        memcpy(mats[i].ambient, m.ambient, sizeof(m.ambient));
+        memcpy(mats[i].diffuse, m.diffuse, sizeof(m.diffuse));
+        memcpy(mats[i].specular, m.specular, sizeof(m.specular));
+        memcpy(mats[i].transmittance, m.transmittance, sizeof(m.transmittance));
+        memcpy(mats[i].emission, m.emission, sizeof(m.emission));
+        mats[i].shininess = m.shininess;
+        mats[i].ior = m.ior;
+        mats[i].dissolve = m.dissolve;
+        mats[i].illum = m.illum;
+    }
+
+    // Write to a temporary file and rename it so that a reader never sees a half written cache
+    std::string path = mesh_cache_path(obj_file);
+    std::string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if(f == NULL) return false;
+
+    unsigned long long pos = 0;
+    bool ok = write_section(f, pos, 0, &h, sizeof(h), 1) &&
+              write_section(f, pos, shape_offset, table.empty() ? NULL : &table[0], sizeof(mesh_cache_shape), table.size()) &&
+              write_section(f, pos, mat_offset, mats.empty() ? NULL : &mats[0], sizeof(mesh_cache_material), mats.size()) &&
+              write_section(f, pos, mtl_offset, mtl_files.empty() ? NULL : &mtl_files[0], sizeof(mesh_cache_source), mtl_files.size());
+    for(unsigned int i = 0; ok && i < shapes.size(); i++){
+        tinyobj::mesh_t &m = shapes[i].mesh;
+        ok = write_section(f, pos, table[i].positions, m.positions.empty() ? NULL : &m.positions[0], sizeof(float), m.positions.size()) &&
+             write_section(f, pos, table[i].normals, m.normals.empty() ? NULL : &m.normals[0], sizeof(float), m.normals.size()) &&
+             write_section(f, pos, table[i].indices, m.indices.empty() ? NULL : &m.indices[0], sizeof(unsigned int), m.indices.size()) &&
+             write_section(f, pos, table[i].material_ids, m.material_ids.empty() ? NULL : &m.material_ids[0], sizeof(int), m.material_ids.size());
+    }
+    ok = ok && write_section(f, pos, h.file_size, NULL, 1, 0);
+
+    if(fclose(f) != 0) ok = false;
+    if(!ok || rename(tmp.c_str(), path.c_str()) != 0){
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
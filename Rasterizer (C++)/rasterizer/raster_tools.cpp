@@ -1,9 +1,12 @@
 #include "raster_tools.h"
+#include "span_raster.h"
 #include <assert.h>
 #include <stdlib.h> // malloc and free are defined here
 #include <string.h> // string.h contains the prototype for memset()
 #include <assert.h> // needed to use the assert() function for debugging
 #include <math.h>
+#include <stdio.h>
+#include <algorithm>
 
 // Create a new image of specified size.
 img_t *new_img(int w, int h) {
@@ -24,6 +27,13 @@ img_t *new_img(int w, int h) {
   return img;
 }
 
+// Make a copy of an image
+img_t *copy_img(const img_t *img) {
+  img_t *copy = new_img(img->w, img->h);
+  memcpy(copy->data, img->data, img->w * img->h * sizeof(pixel_t));
+  return copy;
+}
+
 // Destroy an image and free up its memory
 void destroy_img(img_t **img) {
   // step 1: free the image pixels
@@ -70,9 +80,7 @@ void write_ppm(const img_t *img, const char *fname) {
 // Read camera file and find perspective matrix
 cam_dat get_permat(char *cam_file){
 
-    cam_dat cam;
-
-    float left, right, top, bottom, near, far, eye_x, eye_y, eye_z, center_x, center_y, center_z, up_x, up_y, up_z;
+    float params[15];
 
     assert(cam_file != NULL); // crash if fname is NULL
 
@@ -81,8 +89,36 @@ cam_dat get_permat(char *cam_file){
     assert(f != NULL); // crash if the file didn't open
 
     fscanf(f, "%f %f %f %f %f %f %f %f %f %f %f %f %f %f %f",
-           &left, &right, &top, &bottom, &near, &far, &eye_x, &eye_y, &eye_z,
-           &center_x, &center_y, &center_z, &up_x, &up_y, &up_z); // read in the parameters
+           &params[0], &params[1], &params[2], &params[3], &params[4], &params[5], &params[6], &params[7], &params[8],
+           &params[9], &params[10], &params[11], &params[12], &params[13], &params[14]); // read in the parameters
+
+    fclose(f);
+
+    return get_permat(params);
+}
+
+// Find perspective matrix from the 15 camera parameters
+cam_dat get_permat(float *params){
+
+    cam_dat cam;
+
+    float left, right, top, bottom, near, far, eye_x, eye_y, eye_z, center_x, center_y, center_z, up_x, up_y, up_z;
+
+    left =  params[0];
+    right =  params[1];
+    top =  params[2];
+    bottom =  params[3];
+    near =  params[4];
+    far =  params[5];
+    eye_x =  params[6];
+    eye_y =  params[7];
+    eye_z =  params[8];
+    center_x =  params[9];
+    center_y =  params[10];
+    center_z =  params[11];
+    up_x =  params[12];
+    up_y =  params[13];
+    up_z =  params[14];
 
 //    Estimating aspect ratio and tan of (FOV / 2)
 //    float aspect = ( right - left ) / ( top  - bottom );
@@ -121,993 +157,828 @@ cam_dat get_permat(char *cam_file){
     return cam;
 }
 
-// Convert the vertices to pixel coordinates (Also calculate Z in [0,1]) and return vector of triangles
-vector<face> world_to_im(tinyobj::shape_t &shapes, vector <vec4> &homo_coord, vector <vec4> &normals){
-
-    // Initialize containers to store data about triangles, index and depth of the 3 vertices
-    vector<face> triangles;
-    unsigned int ind;
-    float z1,z2,z3;
+// Snap pixel coordinates to the fixed point grid
+fx_pt snap_pt(float x, float y){
 
-    // Loop through to store the triangles data
-    for(unsigned int i = 0; i < shapes.mesh.indices.size(); i += 3){
-        face temp;
+    fx_pt s;
 
-        // Use index data to find the 3 vertices
-        ind = shapes.mesh.indices[i];
-        temp.p1 = homo_coord[ind];
-        z1 = temp.p1[2];
-//        cout<<temp.p1<<endl;
+    // Clamp first so that vertices far off screen (or behind the eye) still fit in an int
+    x = min(max(x, (float)-FX_LIMIT), (float)FX_LIMIT);
+    y = min(max(y, (float)-FX_LIMIT), (float)FX_LIMIT);
 
-        ind = shapes.mesh.indices[i+1];
-        temp.p2 = homo_coord[ind];
-        z2 = temp.p2[2];
-
-        ind = shapes.mesh.indices[i+2];
-        temp.p3 = homo_coord[ind];
-        z3 = temp.p3[2];
-
-        // Check if all the depth values are within the near and far distance
-        if (!((z1 > 1 && z2 > 1 && z3 > 1) || (z1 < 0 && z2 < 0 && z3 < 0))){
-
-            // Add normal data to the temporary face container
-            temp.n1 = normals[shapes.mesh.indices[i]];
-            temp.n2 = normals[shapes.mesh.indices[i+1]];
-            temp.n3 = normals[shapes.mesh.indices[i+2]];
-
-            // Add face container to the list of triangles
-            triangles.push_back(temp);
-//            cout<<temp.p1<<endl<<temp.p2<<endl<<temp.p3<<endl<<endl;
-
-        }
-
-    }
-
-    return triangles;
+    // Round to the nearest 1/FX_ONE of a pixel
+    s.x = (int)floor((x * FX_ONE) + 0.5);
+    s.y = (int)floor((y * FX_ONE) + 0.5);
 
+    return s;
 }
 
-// Given the pixels of triangles find the bounding box for each of them
-vector<bbox> get_bbox(vector<face> &pix_triangles, int w, int h){
-
-    // Initialize containers to store info about minimum x and y values for each face.
-    vector <bbox> bboxes;
-    float min_x, min_y, max_x, max_y;
-    bbox temp;
-
-    // List to store indexes of removed triangles
-    vector <int> rem;
-
-    int count = 0;
-
-    for( face v : pix_triangles){
-
-        // Find minimum x and y coordinates (clamp with 0 limit)
-        min_x = max(min(min(v.p1[0],v.p2[0]),v.p3[0]),(float)0.0);
-        min_y = max(min(min(v.p1[1],v.p2[1]),v.p3[1]),(float)0.0);
-
-        // If the minimum coordinates are out of the plane add its index to the removed list
-        if((min_x > w) || (min_y > h)){
-            rem.insert(rem.begin(),count);
-            count++;
-            continue;}
-
-        // Find minimum x and y coordinates (clamp with w/h limit)
-        max_x = min(max(max(v.p1[0],v.p2[0]),v.p3[0]),(float)w);
-        max_y = min(max(max(v.p1[1],v.p2[1]),v.p3[1]),(float)h);
-
-        // If the maximum coordinates are out of the plane add its index to the removed list
-        if((max_x < 0.0) || (max_y < 0.0)){
-            rem.insert(rem.begin(),count);
-            count++;
-            continue;}
-
-        // Estimate bounding box using the minimum and maximum pixel values
-        temp.x = min_x;
-        temp.y = min_y;
-        temp.w = max_x - min_x;
-        temp.h = max_y - min_y;
-        bboxes.push_back(temp);
-        count++;
-
-    }
-
-    // Removing faces that are not completely in the screen
-    for(unsigned int i = 0; i < rem.size(); i++){
+// Sample positions of the multisampling patterns
+const fx_pt *msaa_pattern(int n){
 
-        pix_triangles.erase(pix_triangles.begin() + rem[i]);
-
-    }
-return bboxes;
+    // Offsets from the pixel center in 1/16th of a pixel. No two samples share a row or a column,
+    // so near horizontal and near vertical edges still get as many coverage levels as there are samples.
+    static const fx_pt pattern_2[2] = {{4, 4}, {-4, -4}};
+    static const fx_pt pattern_4[4] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+    static const fx_pt pattern_8[8] = {{1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7}};
 
+    if(n == 2) return pattern_2;
+    if(n == 4) return pattern_4;
+    if(n == 8) return pattern_8;
+    return NULL;
 }
 
+// Make a view of a parsed mesh
+mesh_view view_mesh(const tinyobj::mesh_t &mesh){
 
-// Scan along each row and find left and right edge intersections.
-vector<corn_pts> get_corners(vector<face> &pix_triangle, vector<bbox> &bboxes){
-
-    // Initialize containers to hold corners, current bbox, current face and vector to store triangle line data for current face.
-    vector<corn_pts> corners;
-    bbox b;
-    face f;
-    vector <line_dat> triang_line;
-
-    // Store limits of the scan lines
-    float y_start, y_end;
-
-    // Looping through number of bounding boxes
-    for(unsigned int i = 0; i < bboxes.size(); i++){
-
-        corn_pts c;
-
-        b = bboxes[i];
-        f = pix_triangle[i];
-
-        // Define limits of the scan lines
-        y_start = floor(b.y);
-        y_end = ceil(b.y + b.h);
-//        cout<<y_start<<" "<<y_end<<endl;
-
-        line_dat line;
-
-        // Check the vertex which has the bigger x coordinate and store it as p2 of the line. Smaller one as p1.
-        // Do this for all the 3 lines of the triangle
-        // Also store the slope of each line
-        if(f.p1[0] >= f.p2[0]){
-            line.p1 = f.p2;
-            line.p2 = f.p1;
-        }
-        else{
-            line.p1 = f.p1;
-            line.p2 = f.p2;
-        }
-        line.m = ((line.p2[1] - line.p1[1]) / (line.p2[0] - line.p1[0]));
-        triang_line.push_back(line);
-
-        if(f.p2[0] >= f.p3[0]){
-            line.p1 = f.p3;
-            line.p2 = f.p2;
-        }
-        else{
-            line.p1 = f.p2;
-            line.p2 = f.p3;
-        }
-        line.m = ((line.p2[1] - line.p1[1]) / (line.p2[0] - line.p1[0]));
-        triang_line.push_back(line);
-
-        if(f.p1[0] >= f.p3[0]){
-            line.p1 = f.p3;
-            line.p2 = f.p1;
-        }
-        else{
-            line.p1 = f.p1;
-            line.p2 = f.p3;
-        }
-        line.m = ((line.p2[1] - line.p1[1]) / (line.p2[0] - line.p1[0]));
-        triang_line.push_back(line);
-
-        //Vector to store intersection points for a particular scan line
-        vector <vec4> in;
-
-        //Float to store x value during scanning
-        float x;
-
-        // Loop for each scan
-        for(float j = y_start; j <= y_end; j+=1.0){
-
-            // Loop to find intersections of the scan line with the sides of the triangle
-            for( line_dat l : triang_line){
-
-                // Deal with horizontal lines
-                // Check if slope is zero
-                // Check if the line has the same y axis as the scan line
-                if(l.m == 0){
-
-                   if(j == l.p1[1]){
-
-                       // If scan line is concurrent with the line, push the end points along with index information of the end points
-                       in.push_back(vec4(l.p1[0],l.p1[1],l.p1[3],l.p2[3]));
-                       in.push_back(vec4(l.p2[0],l.p2[1],l.p1[3],l.p2[3]));
-                        break;
-
-                   }
-
-               }
-
-               // Deal with vertical lines
-               // If slope is infinity, check if the height of the scan line is between the y coordinates of the end points
-               if(isinf(l.m)){
-
-                   if( (j<=max(l.p1[1],l.p2[1])) && (j>=min(l.p1[1],l.p2[1])) ){
-
-                       // If it lies in between push the point and the indexes of the end points
-                       in.push_back(vec4(l.p1[0],j,l.p1[3],l.p2[3]));
-                       continue;
-
-                   }
-
-               }
-
-               // Deal with normal lines
-               // If the scan line lies between the y coordinates of the end points it intersects it.
-               if( (j<=max(l.p1[1],l.p2[1])) && (j>=min(l.p1[1],l.p2[1])) ){
-
-                   // Calculate the x coordinate of intersection point
-                   x = (j - l.p1[1] + (l.m*l.p1[0])) / l.m;
-                   in.push_back(vec4(x,j,l.p1[3],l.p2[3]));
+    mesh_view v;
+    v.n_verts = mesh.positions.size() / 3;
+    v.n_indices = mesh.indices.size();
+    v.positions = mesh.positions.empty() ? NULL : &mesh.positions[0];
 
-               }
-
-            }
-
-            // NOTE: If the scan line touches the vertex, the same point will be added to the 'in' vector twice. So no need to handle that case.
-
-            // If the number of intersection points is greater than 2 remove one of the equal pair
-            if(in.size()>2){
-                float eps = 0.001;
-                if((in[0][0] - in[1][0] < eps) && (in[0][1] - in[1][1] < eps)){in.erase(in.begin());}
-                else if((in[0][0] - in[2][0] < eps) && (in[0][1] - in[2][1] < eps)){in.erase(in.begin());}
-                else{in.erase(in.begin()+2);}
-            }
-
-            // Sometimes it may happen that the scan line may pass through without intersection
-            if(in.size() == 0){
-                continue;
-            }
-
-            // Check which intersection point has a greater x value and store it as the left intersection
-            if(in[0][0] < in[1][0]){
-                c.lef.push_back(in[0]);
-                c.rig.push_back(in[1]);
-            }
-
-            else{
-                c.lef.push_back(in[1]);
-                c.rig.push_back(in[0]);
-            }
-
-            in.clear();
+    // Normals are only used if there is one for every vertex
+    v.normals = (mesh.normals.size() == mesh.positions.size() && !mesh.normals.empty()) ? &mesh.normals[0] : NULL;
+    v.indices = mesh.indices.empty() ? NULL : &mesh.indices[0];
+    v.material_ids = mesh.material_ids.empty() ? NULL : &mesh.material_ids[0];
+    return v;
+}
 
+// Copy some triangles of a mesh along with the vertices they use
+void slice_mesh(const mesh_view &mesh, size_t first, size_t count, tinyobj::mesh_t &out, vector<unsigned int> &used){
+
+    const unsigned int *indices = mesh.indices + 3*first;
+    size_t n = 3*count;
+
+    // Sorted list of the vertices used by the triangles
+    used.assign(indices, indices + n);
+    sort(used.begin(), used.end());
+    used.erase(unique(used.begin(), used.end()), used.end());
+
+    // Copy the vertices in that order
+    out.positions.resize(3 * used.size());
+    out.normals.resize(mesh.normals ? 3 * used.size() : 0);
+    out.texcoords.clear();
+    for(size_t k = 0; k < used.size(); k++){
+        memcpy(&out.positions[3*k], mesh.positions + 3*used[k], 3 * sizeof(float));
+        if(mesh.normals){
+            memcpy(&out.normals[3*k], mesh.normals + 3*used[k], 3 * sizeof(float));
         }
-//        cout<<c.lef.size()<<" "<<c.rig.size()<<endl;
-
-        corners.push_back(c);
-        triang_line.clear();
     }
 
-    return corners;
-}
-
-// Filling the image using intersection points and other info as required by a particular option.
-img_t *fill_img(img_t *img, vector<face> triangles, vector<corn_pts> &corner_pts,
-                tinyobj::material_t &materials, vector <float> &z,  vector <vec4> &homo_coord, vector <vec4> &normals,
-                char *opt){
-
-    // Check the option and run the required function
-    if(opt == NULL){
-
-        img = default_col(img, corner_pts,materials, z, homo_coord);
-
+    // Renumber the corners of the triangles
+    out.indices.resize(n);
+    for(size_t i = 0; i < n; i++){
+        out.indices[i] = lower_bound(used.begin(), used.end(), indices[i]) - used.begin();
     }
-    else if (strcmp (opt, "--white") == 0) {
-
-        img = white_col(img, corner_pts, z, homo_coord);
 
+    if(mesh.material_ids){
+        out.material_ids.assign(mesh.material_ids + first, mesh.material_ids + first + count);
     }
-    else if (strcmp (opt, "--norm_flat") == 0) {
-
-        img = flat_col(img, triangles, corner_pts, z, homo_coord);
-
+    else{
+        out.material_ids.clear();
     }
-    else if (strcmp (opt, "--norm_gouraud") == 0) {
+}
 
-        img = gouraud_col(img, corner_pts, z, homo_coord, normals);
+// Check whether a triangle covers the center of a pixel of a w x h image (or overlaps a pixel when multisampling)
+static bool covers_sample(face &f, int w, int h, int samples){
 
+    // Any sample of the pixels overlapped by the triangle may be covered. Those are left to the rasterizer.
+    if(samples > 1){
+        edge_walk e;
+        rect clip = {0, 0, w, h};
+        return edge_setup(e, f, clip, true);
     }
-    else if (strcmp (opt, "--norm_bary") == 0) {
 
-        img = bary_col(img, triangles, corner_pts, z);
+    // Range of pixel centers in the bounding box of the triangle (the center of pixel x is at x * FX_ONE + FX_ONE / 2)
+    int x0 = max(0, (min(min(f.s1.x, f.s2.x), f.s3.x) - (FX_ONE / 2) + (FX_ONE - 1)) >> FX_BITS);
+    int x1 = min(w - 1, (max(max(f.s1.x, f.s2.x), f.s3.x) - (FX_ONE / 2)) >> FX_BITS);
+    int y0 = max(0, (min(min(f.s1.y, f.s2.y), f.s3.y) - (FX_ONE / 2) + (FX_ONE - 1)) >> FX_BITS);
+    int y1 = min(h - 1, (max(max(f.s1.y, f.s2.y), f.s3.y) - (FX_ONE / 2)) >> FX_BITS);
+    if((x0 > x1) || (y0 > y1)) return false;
+
+    // Larger triangles almost always cover a pixel and are left to the rasterizer
+    if((x1 - x0 + 1) * (y1 - y0 + 1) > CULL_SMALL_PIXELS) return true;
+
+    // Small ones are walked with the same edge functions and fill rule as the rasterizer
+    edge_walk e;
+    rect clip = {0, 0, w, h};
+    int y, x_start, x_stop;
+    return edge_setup(e, f, clip) && next_span(e, y, x_start, x_stop);
+}
 
-    }
-    else if (strcmp (opt, "--norm_gouraud_z") == 0) {
+// Clip space outcode of a point
+unsigned char clip_code(float x, float y, float z, float w){
+
+    float g = CLIP_GUARD_BAND * w;
+    unsigned char code = 0;
+    if(x < -w) code |= CLIP_LEFT;
+    if(w < x) code |= CLIP_RIGHT;
+    if(y < -w) code |= CLIP_BOTTOM;
+    if(w < y) code |= CLIP_TOP;
+    if(z < 0) code |= CLIP_NEAR;
+    if(w < z) code |= CLIP_FAR;
+    if((x < -g) || (g < x) || (y < -g) || (g < y)) code |= CLIP_GUARD;
+    return code;
+}
 
-        img = gouraud_col_z(img, corner_pts, z, homo_coord, normals);
+// Run the culling tests that only need the snapped points of a triangle. Counts the triangle in stats if it is removed.
+static bool keep_triangle(face &f, int w, int h, cull_mode cull, render_stats &stats, int samples){
 
+    // Remove the triangles with no area and those facing the culled way
+    long long area = t_area_fx(f.s1, f.s2, f.s3);
+    if(area == 0){
+        stats.culled_zero_area++;
+        return false;
     }
-    else if (strcmp (opt, "--norm_bary_z") == 0) {
-
-        img = bary_col_z(img, triangles, corner_pts, z);
-
+    if(((cull == CULL_BACK) && (area < 0)) || ((cull == CULL_FRONT) && (area > 0))){
+        stats.culled_facing++;
+        return false;
     }
 
-    return img;
-
+    // Leave out the triangles that are too small or too far off screen to cover a pixel center
+    if(!covers_sample(f, w, h, samples)){
+        stats.culled_no_sample++;
+        return false;
+    }
+    return true;
 }
 
-// Coloring using the diffuse property in the materials object
-img_t *default_col(img_t *img, vector<corn_pts> &corner_pts, tinyobj::material_t &materials,
-                   vector<float> &z, vector <vec4> &homo_coord){
-//    cout<<"ok"<<endl;
-
-    int w = img->w;
-
-    // Set color as the color from the diffuse property
-    unsigned int color[] = {(unsigned int)round(materials.diffuse[0]*255.0),(unsigned int)round(materials.diffuse[1]*255.0),
-                             (unsigned int)round(materials.diffuse[2]*255.0)};
-
-    // Initialize variables
-    vec4 temp, p_start, p_stop;
-    int start, stop, x_start, x_stop, y;
-    float z_start,z_stop,z_cur;
-    int count;
-
-    //Loop through the number of triangles = size of corner_pts
-    for(unsigned int i = 0; i < corner_pts.size(); i++){
-
-        // Loop through the pairs of intersections
-        for(unsigned int j = 0; j < corner_pts[i].lef.size(); j++){
-
-            //Left intersection point in the image
-            temp = corner_pts[i].lef[j];
-            x_start = max(0,(int)temp[0]);
-
-            // If the left intersection point is greater than the width, then discard the scan line
-            if(x_start>=w)  continue;
-            y = (int)temp[1];
-
-            // Interpolate the depth value using the vertices of the line in which it lies
-            z_start = interp_z(homo_coord[temp[2]],homo_coord[temp[3]],temp[0],temp[1]);
-
-            // Store start vector
-            p_start = vec4((int)temp[0],(int)temp[1],z_start,1);
-
-            // Store position of the start point (may not be equal to the start vector xy value)
-            start = (y*w) + (x_start);
-
-            //Right intersection point in the image
-            temp = corner_pts[i].rig[j];
-            x_stop = min((int)temp[0],w-1);
-
-            // If the right intersection point is less than 0, then discard the scan line
-            if(x_stop<0) continue;
-            y = (int)temp[1];
-
-            // Interpolate the depth value using the vertices of the line in which it lies
-            z_stop = interp_z(homo_coord[temp[2]],homo_coord[temp[3]],temp[0],temp[1]);
-
-            // Store stop vector
-            p_stop = vec4((int)temp[0],(int)temp[1],z_stop,1);
-
-            // Store position of the start point (may not be equal to the stop vector xy value)
-            stop = (y*w) + (x_stop);
-
-            count = 0;
-
-            //Loop to assign pixel value of the row from the start point to the stop point
-            for (pixel_t *p = (img->data + start); p <= (img->data + stop); p++) {
-
-                // Find current depth using interpolation of depth of end points
-                z_cur = interp_z(p_start,p_stop,x_start + count, y);
-                count ++;
-
-                // If the depth is within range and lower than current depth value in the buffer update the pixel color and the Z-buffer
-                if((z_cur<z[p-(img->data)]) && (z_cur>0) && (z_cur<1)){
-                    z[p-(img->data)] = z_cur;
-                    p->r = color[0];
-                    p->g = color[1];
-                    p->b = color[2];
-                }
-            }
-        }
+// A vertex of a triangle being clipped
+struct clip_vert{
+  vec4 c; // Clip space position
+  vec4 n; // Normal in the camera frame
+};
+
+// Signed distance of a clip space point to one of the clipping planes (positive inside)
+static float clip_dist(const vec4 &c, int plane){
+    switch(plane){
+    case 0: return c[2];                              // Near
+    case 1: return c[0] + (CLIP_GUARD_BAND * c[3]);   // Guard band left
+    case 2: return (CLIP_GUARD_BAND * c[3]) - c[0];   // Guard band right
+    case 3: return c[1] + (CLIP_GUARD_BAND * c[3]);   // Guard band bottom
+    default: return (CLIP_GUARD_BAND * c[3]) - c[1];  // Guard band top
     }
-    return img;
 }
 
-// Coloring all pixels in the triangle white
-img_t *white_col(img_t *img, vector<corn_pts> &corner_pts, vector <float> &z, vector <vec4> &homo_coord){
-
-    int w = img->w;
-
-    // All pixels are assigned white color
-    unsigned int color[] = {255,255,255};
-
-    // Initialize various container variables
-    vec4 temp, p_start, p_stop;
-    int start, stop, x_start, x_stop, y;
-    float z_start,z_stop,z_cur;
-    int count;
-
-    //Loop through the number of triangles = size of corner_pts
-    for(unsigned int i = 0; i < corner_pts.size(); i++){
-
-        // Loop through the pairs of intersections
-        for(unsigned int j = 0; j < corner_pts[i].lef.size(); j++){
-
-            //Left intersection point in the image
-            temp = corner_pts[i].lef[j];
-            x_start = max(0,(int)temp[0]);
-
-            // If the left intersection point is greater than the width, then discard the scan line
-            if(x_start>=w)  continue;
-            y = (int)temp[1];
-
-            // Interpolate the depth value using the vertices of the line in which it lies
-            z_start = interp_z(homo_coord[temp[2]],homo_coord[temp[3]],temp[0],temp[1]);
+// Project a clip space vertex to the pixel position, depth and 1/w of a face point (same steps as the vertex stage)
+static void project_vert(const clip_vert &v, int w, int h, vec4 &p, vec4 &n, fx_pt &s){
 
-            // Store start vector
-            p_start = vec4((int)temp[0],(int)temp[1],z_start,1);
-
-            // Store position of the start point (may not be equal to the start vector xy value)
-            start = (y*w) + (x_start);
-
-            //Right intersection point in the image
-            temp = corner_pts[i].rig[j];
-            x_stop = min((int)temp[0],w-1);
-
-            // If the right intersection point is less than 0, then discard the scan line
-            if(x_stop<0) continue;
-            y = (int)temp[1];
-
-            // Interpolate the depth value using the vertices of the line in which it lies
-            z_stop = interp_z(homo_coord[temp[2]],homo_coord[temp[3]],temp[0],temp[1]);
-
-            // Store stop vector
-            p_stop = vec4((int)temp[0],(int)temp[1],z_stop,1);
-
-            // Store position of the start point (may not be equal to the stop vector xy value)
-            stop = (y*w) + (x_stop);
-
-            count = 0;
-
-            //Loop to assign pixel value of the row from the start point to the stop point
-            for (pixel_t *p = (img->data + start); p <= (img->data + stop); p++) {
-
-                // Find current depth using interpolation of depth of end points
-                z_cur = interp_z(p_start,p_stop,x_start + count, y);
-                count ++;
+    float hw = v.c[3];
+    float x = ((v.c[0] / hw) + 1) * (float)w * 0.5f;
+    float y = (1 - (v.c[1] / hw)) * (float)h * 0.5f;
+    s = snap_pt(x, y);
+    p = vec4((float)s.x / FX_ONE, (float)s.y / FX_ONE, v.c[2] / hw, 1.0f / hw);
+    n = v.n;
+}
 
-                // If the depth is within range and lower than current depth value in the buffer update the pixel color and the Z-buffer
-                if((z_cur<z[p-(img->data)]) && (z_cur>0) && (z_cur<1)){
-                    z[p-(img->data)] = z_cur;
-                    p->r = color[0];
-                    p->g = color[1];
-                    p->b = color[2];
-                }
+// Clip a triangle against the near plane (and the guard band if it crosses it) and add the pieces to triangles
+static void clip_triangle(clip_vert *in, bool guard, int w, int h, cull_mode cull, render_stats &stats, int samples,
+                          vector<face> &triangles){
+
+    // Sutherland-Hodgman: clip the polygon against one plane at a time
+    clip_vert buf[2][CLIP_MAX_VERTS + 1];
+    clip_vert *poly = buf[0], *next = buf[1];
+    int n = 3;
+    for(int k = 0; k < 3; k++) poly[k] = in[k];
+
+    for(int plane = 0; plane < (guard ? 5 : 1); plane++){
+        int m = 0;
+        for(int k = 0; k < n; k++){
+            const clip_vert &a = poly[k];
+            const clip_vert &b = poly[(k + 1) % n];
+            float da = clip_dist(a.c, plane);
+            float db = clip_dist(b.c, plane);
+            if(da >= 0) next[m++] = a;
+
+            // The edge crosses the plane. Attributes are linear in clip space.
+            if((da >= 0) != (db >= 0)){
+                float t = da / (da - db);
+                next[m].c = a.c + ((b.c - a.c) * t);
+                next[m].n = a.n + ((b.n - a.n) * t);
+                m++;
             }
         }
+        swap(poly, next);
+        n = m;
+        if(n < 3) return;
     }
-    return img;
-}
-
-// Coloring all the pixels using the normal of the 1st vertex
-img_t *flat_col(img_t *img, vector <face> &triangles, vector<corn_pts> &corner_pts, vector <float> &z,
-                 vector <vec4> &homo_coord){
-
-    int w = img->w;
-
-    // Initialize various container variables
-    vec4 temp, p_start, p_stop;
-    int start, stop, x_start, x_stop, y;
-    float z_start,z_stop,z_cur;
-    vec4 norm_cur;
-    vector<unsigned int> color = {255,255,255};
-    int count;
-
-    //Loop through the number of triangles = size of corner_pts
-    for(unsigned int i = 0; i < corner_pts.size(); i++){
-
-        // Extract the first normal from the face
-        norm_cur = triangles[i].n1;
-
-        // Get color from the normal
-        color = get_color(color,norm_cur);
-
-        // Loop through the pairs of intersections
-        for(unsigned int j = 0; j < corner_pts[i].lef.size(); j++){
-
-            //Left intersection point in the image
-            temp = corner_pts[i].lef[j];
-            x_start = max(0,(int)temp[0]);
-
-            // If the left intersection point is greater than the width, then discard the scan line
-            if(x_start>=w)  continue;
-            y = (int)temp[1];
-
-            // Interpolate the depth value using the vertices of the line in which it lies
-            z_start = interp_z(homo_coord[temp[2]],homo_coord[temp[3]],temp[0],temp[1]);
 
-            // Store start vector
-            p_start = vec4((int)temp[0],(int)temp[1],z_start,1);
-
-            // Store position of the start point (may not be equal to the start vector xy value)
-            start = (y*w) + (x_start);
-
-            //Right intersection point in the image
-            temp = corner_pts[i].rig[j];
-            x_stop = min((int)temp[0],w-1);
-
-            // If the right intersection point is less than 0, then discard the scan line
-            if(x_stop<0) continue;
-            y = (int)temp[1];
-
-            // Interpolate the depth value using the vertices of the line in which it lies
-            z_stop = interp_z(homo_coord[temp[2]],homo_coord[temp[3]],temp[0],temp[1]);
-
-            // Store stop vector
-            p_stop = vec4((int)temp[0],(int)temp[1],z_stop,1);
-
-            // Store position of the start point (may not be equal to the stop vector xy value)
-            stop = (y*w) + (x_stop);
-
-            count = 0;
-
-            //Loop to assign pixel value of the row from the start point to the stop point
-            for (pixel_t *p = (img->data + start); p <= (img->data + stop); p++) {
-
-                // Find current depth using interpolation of depth of end points
-                z_cur = interp_z(p_start,p_stop,x_start + count, y);
-                count ++;
-
-                // If the depth is within range and lower than current depth value in the buffer update the pixel color and the Z-buffer
-                if((z_cur<z[p-(img->data)]) && (z_cur>0) && (z_cur<1)){
-                    z[p-(img->data)] = z_cur;
-                    p->r = color[0];
-                    p->g = color[1];
-                    p->b = color[2];
-                }
-            }
+    // Split the polygon into a fan of triangles
+    face temp;
+    project_vert(poly[0], w, h, temp.p1, temp.n1, temp.s1);
+    for(int k = 1; k + 1 < n; k++){
+        project_vert(poly[k], w, h, temp.p2, temp.n2, temp.s2);
+        project_vert(poly[k + 1], w, h, temp.p3, temp.n3, temp.s3);
+        if(keep_triangle(temp, w, h, cull, stats, samples)){
+            triangles.push_back(temp);
+            stats.drawn++;
         }
     }
-    return img;
 }
 
-// Coloring using gouraud shading
-img_t *gouraud_col(img_t *img, vector<corn_pts> &corner_pts, vector <float> &z,
-                 vector <vec4> &homo_coord, vector <vec4> &normals){
-
-    int w = img->w;
-
-    // Initialize various container variables
-    vec4 temp, p_start, p_stop;
-    int start, stop, x_start, x_stop, y;
-    pt_info pt_start, pt_stop, pt_cur;
-    vector<unsigned int> color = {255,255,255};
-    int count;
-
-    //Loop through the number of triangles = size of corner_pts
-    for(unsigned int i = 0; i < corner_pts.size(); i++){
-
-
-        // Loop through the pairs of intersections
-        for(unsigned int j = 0; j < corner_pts[i].lef.size(); j++){
-
-            //Left intersection point in the image
-            temp = corner_pts[i].lef[j];
-            x_start = max(0,(int)temp[0]);
-
-            // If the left intersection point is greater than the width, then discard the scan line
-            if(x_start>=w)  continue;
-            y = (int)temp[1];
-
-            // Get interpolated depth and normal values from the values at the vertex
-            pt_start = interp_pt(normals[temp[2]],normals[temp[3]],homo_coord[temp[2]],homo_coord[temp[3]],
-                    temp[0],temp[1]);
-
-            // Store start vector
-            p_start = vec4((int)temp[0],(int)temp[1],pt_start.z,1);
-
-            // Store position of the start point (may not be equal to the start vector xy value)
-            start = (y*w) + (x_start);
+// Gather the transformed vertices of each triangle into the vector of triangles, clipping and leaving out the culled ones
+void world_to_im(mesh_view &mesh, vert_soa &verts, vector<face> &triangles, cam_dat &cam, int w, int h,
+                 cull_mode cull, render_stats &stats, int samples){
 
-            //Right intersection point in the image
-            temp = corner_pts[i].rig[j];
-            x_stop = min((int)temp[0],w-1);
+    // Reuse the container. Clearing keeps its memory so later frames do not allocate.
+    triangles.clear();
 
-            // If the right intersection point is less than 0, then discard the scan line
-            if(x_stop<0) continue;
-            y = (int)temp[1];
+    // Initialize containers to store the index and depth of the 3 vertices
+    unsigned int i1, i2, i3;
+    unsigned char c1, c2, c3;
 
-            // Get interpolated depth and normal values from the values at the vertex
-            pt_stop = interp_pt(normals[temp[2]],normals[temp[3]],homo_coord[temp[2]],homo_coord[temp[3]],
-                    temp[0],temp[1]);
-
-            // Store start vector
-            p_stop = vec4((int)temp[0],(int)temp[1],pt_stop.z,1);
-
-            // Store position of the start point (may not be equal to the start vector xy value)
-            stop = (y*w) + (x_stop);
-
-            count = 0;
-
-            //Loop to assign pixel value of the row from the start point to the stop point
-            for (pixel_t *p = (img->data + start); p <= (img->data + stop); p++) {
+    // Loop through to store the triangles data
+    for(size_t i = 0; i + 2 < mesh.n_indices; i += 3){
+        face temp;
+        stats.triangles++;
 
-                // Get interpolated depth and normal values from the values at the vertex
-                pt_cur = interp_pt(pt_start.norm,pt_stop.norm,p_start, p_stop, x_start + count, y);
-                count ++;
+        // Use index data to find the 3 vertices
+        i1 = mesh.indices[i];
+        i2 = mesh.indices[i+1];
+        i3 = mesh.indices[i+2];
+        c1 = verts.clip[i1];
+        c2 = verts.clip[i2];
+        c3 = verts.clip[i3];
+
+        // Trivial reject: all the vertices are outside the same plane of the view frustum
+        if(c1 & c2 & c3 & CLIP_FRUSTUM){
+            stats.culled_frustum++;
+            continue;
+        }
 
-                // If the depth is within range and lower than current depth value in the buffer update the pixel color and the Z-buffer
-                if((pt_cur.z<z[p-(img->data)]) && (pt_cur.z>0) && (pt_cur.z<1)){
-                    z[p-(img->data)] = pt_cur.z;
-                    color = get_color(color,pt_cur.norm);
-                    p->r = color[0];
-                    p->g = color[1];
-                    p->b = color[2];
-                }
+        // Clip the triangles crossing the near plane (their projection is meaningless) or leaving the guard band.
+        // The clip space positions are computed again from the mesh with the same order of sums as the vertex stage.
+        if((c1 | c2 | c3) & (CLIP_NEAR | CLIP_GUARD)){
+            stats.clipped++;
+            clip_vert v[3];
+            unsigned int idx[3] = {i1, i2, i3};
+            const mat4 &m = cam.per_mat;
+            for(int k = 0; k < 3; k++){
+                const float *p = mesh.positions + 3*idx[k];
+                v[k].c = vec4(((m[0][0] * p[0]) + (m[1][0] * p[1]) + (m[2][0] * p[2])) + m[3][0],
+                              ((m[0][1] * p[0]) + (m[1][1] * p[1]) + (m[2][1] * p[2])) + m[3][1],
+                              ((m[0][2] * p[0]) + (m[1][2] * p[1]) + (m[2][2] * p[2])) + m[3][2],
+                              ((m[0][3] * p[0]) + (m[1][3] * p[1]) + (m[2][3] * p[2])) + m[3][3]);
+                v[k].n = vec4(verts.nx[idx[k]], verts.ny[idx[k]], verts.nz[idx[k]], 0);
             }
+            clip_triangle(v, ((c1 | c2 | c3) & CLIP_GUARD) != 0, w, h, cull, stats, samples, triangles);
+            continue;
         }
-    }
-    return img;
-}
 
-// Coloring using barycentric coordinates
-img_t *bary_col(img_t *img, vector<face> &triangles, vector<corn_pts> &corner_pts, vector <float> &z){
+        // Trivially accepted: the snapped pixel coordinates used for the coverage tests are enough for the culling tests
+        temp.s1 = verts.s[i1];
+        temp.s2 = verts.s[i2];
+        temp.s3 = verts.s[i3];
+        if(!keep_triangle(temp, w, h, cull, stats, samples)) continue;
 
-    int w = img->w;
+        // Pixel coordinates, depth and 1/w of the vertices
+        temp.p1 = vec4(verts.x[i1], verts.y[i1], verts.z[i1], verts.iw[i1]);
+        temp.p2 = vec4(verts.x[i2], verts.y[i2], verts.z[i2], verts.iw[i2]);
+        temp.p3 = vec4(verts.x[i3], verts.y[i3], verts.z[i3], verts.iw[i3]);
 
-    // Initialize various container variables
-    vec4 temp;
-    int start, stop, x_start, x_stop, y;
-    pt_info pt_cur;
-    vector<unsigned int> color = {255,255,255};
-    int count;
-    face f;
+        // Add normal data to the temporary face container
+        temp.n1 = vec4(verts.nx[i1], verts.ny[i1], verts.nz[i1], 0);
+        temp.n2 = vec4(verts.nx[i2], verts.ny[i2], verts.nz[i2], 0);
+        temp.n3 = vec4(verts.nx[i3], verts.ny[i3], verts.nz[i3], 0);
 
-    //Loop through the number of triangles = size of corner_pts
-    for(unsigned int i = 0; i < corner_pts.size(); i++){
+        // Add face container to the list of triangles
+        triangles.push_back(temp);
+        stats.drawn++;
 
-        // Set f to current face
-        f = triangles[i];
-
-        // Loop through the pairs of intersections
-        for(unsigned int j = 0; j < corner_pts[i].lef.size(); j++){
-
-            //Left intersection point in the image
-            temp = corner_pts[i].lef[j];
-            x_start = max(0,(int)temp[0]);
-
-            // If the left intersection point is greater than the width, then discard the scan line
-            if(x_start>=w)  continue;
-            y = (int)temp[1];
-
-            // Store position of the start point (may not be equal to the start vector xy value)
-            start = (y*w) + (x_start);
-
-            //Right intersection point in the image
-            temp = corner_pts[i].rig[j];
-            x_stop = min((int)temp[0],w-1);
+    }
 
-            // If the right intersection point is less than 0, then discard the scan line
-            if(x_stop<0) continue;
-            y = (int)temp[1];
+}
 
-            // Store position of the start point (may not be equal to the start vector xy value)
-            stop = (y*w) + (x_stop);
+// Depth of the nearest vertex of a triangle
+float near_z(const face &f){
+    return min(min(f.p1[2], f.p2[2]), f.p3[2]);
+}
 
-            count = 0;
+// Sort the triangles coarsely front to back with a counting sort on the depth of their nearest vertex
+void sort_front_to_back(vector<face> &triangles, vector<face> &scratch, vector<size_t> &first){
 
-            //Loop to assign pixel value of the row from the start point to the stop point
-            for (pixel_t *p = (img->data + start); p <= (img->data + stop); p++) {
+    if(triangles.size() < 2) return;
 
-                // Estimate the depth and normal for some point in the triangle using barycentric coordinates
-                pt_cur = interp_barypt(f, x_start + count, y);
+    // Spread the buckets over the depths actually used
+    float z_min = near_z(triangles[0]), z_max = z_min;
+    for(size_t i = 1; i < triangles.size(); i++){
+        float z = near_z(triangles[i]);
+        z_min = min(z_min, z);
+        z_max = max(z_max, z);
+    }
+    if(!(z_max > z_min)) return;
+    float scale = (SORT_DEPTH_BUCKETS - 1) / (z_max - z_min);
 
-                count ++;
+    // Count the triangles in each bucket and turn the counts into the first position of each bucket
+    first.assign(SORT_DEPTH_BUCKETS + 1, 0);
+    for(size_t i = 0; i < triangles.size(); i++){
+        first[(int)((near_z(triangles[i]) - z_min) * scale) + 1]++;
+    }
+    for(int b = 0; b < SORT_DEPTH_BUCKETS; b++){
+        first[b + 1] += first[b];
+    }
 
-                // If the depth is within range and lower than current depth value in the buffer update the pixel color and the Z-buffer
-                if((pt_cur.z<z[p-(img->data)]) && (pt_cur.z>0) && (pt_cur.z<1)){
-                    z[p-(img->data)] = pt_cur.z;
-                    color = get_color(color,pt_cur.norm);
-                    p->r = color[0];
-                    p->g = color[1];
-                    p->b = color[2];
-                }
-            }
-        }
+    // Move every triangle to the next free position of its bucket (triangles in the same bucket keep their order).
+    // The sorted triangles are copied back rather than swapped in, so that every shape keeps its own buffer and the
+    // scratch buffer shared by the shapes only grows to the largest one.
+    scratch.resize(triangles.size());
+    for(size_t i = 0; i < triangles.size(); i++){
+        scratch[first[(int)((near_z(triangles[i]) - z_min) * scale)]++] = triangles[i];
     }
-    return img;
+    copy(scratch.begin(), scratch.end(), triangles.begin());
 }
 
-// Coloring using gouraud shading and perspective corrected depth
-img_t *gouraud_col_z(img_t *img, vector<corn_pts> &corner_pts, vector <float> &z,
-                 vector <vec4> &homo_coord, vector <vec4> &normals){
-    int w = img->w;
-
-    // Initialize various container variables
-    vec4 temp, p_start, p_stop;
-    int start, stop, x_start, x_stop, y;
-    pt_info pt_start, pt_stop, pt_cur;
-    vector<unsigned int> color = {255,255,255};
-    int count;
-
-    //Loop through the number of triangles = size of corner_pts
-    for(unsigned int i = 0; i < corner_pts.size(); i++){
-
-
-        // Loop through the pairs of intersections
-        for(unsigned int j = 0; j < corner_pts[i].lef.size(); j++){
+// Given the pixels of triangles find the bounding box for each of them
+void get_bbox(vector<face> &pix_triangles, int w, int h, vector<bbox> &bboxes){
 
-            //Left intersection point in the image
-            temp = corner_pts[i].lef[j];
-            x_start = max(0,(int)temp[0]);
+    // Initialize containers to store info about minimum x and y values for each face.
+    bboxes.clear();
+    bboxes.reserve(pix_triangles.size());
+    float min_x, min_y, max_x, max_y;
+    bbox temp;
 
-            // If the left intersection point is greater than the width, then discard the scan line
-            if(x_start>=w)  continue;
-            y = (int)temp[1];
+    // Faces that are not in the screen are dropped by compacting the kept ones to the front in a single pass,
+    // so that the order is kept and every face is moved at most once
+    size_t kept = 0;
 
-            // Get interpolated depth and normal values from the values at the vertex
-            pt_start = interp_pt_z(normals[temp[2]],normals[temp[3]],homo_coord[temp[2]],homo_coord[temp[3]],
-                    temp[0],temp[1]);
+    for(size_t i = 0; i < pix_triangles.size(); i++){
+        face &v = pix_triangles[i];
 
-            // Store start vector
-            p_start = vec4((int)temp[0],(int)temp[1],pt_start.z,1);
+        // Find minimum x and y coordinates (clamp with 0 limit)
+        min_x = max(min(min(v.p1[0],v.p2[0]),v.p3[0]),(float)0.0);
+        min_y = max(min(min(v.p1[1],v.p2[1]),v.p3[1]),(float)0.0);
 
-            // Store position of the start point (may not be equal to the start vector xy value)
-            start = (y*w) + (x_start);
+        // If the minimum coordinates are out of the plane leave the face out
+        if((min_x > w) || (min_y > h)) continue;
 
-            //Right intersection point in the image
-            temp = corner_pts[i].rig[j];
-            x_stop = min((int)temp[0],w-1);
+        // Find minimum x and y coordinates (clamp with w/h limit)
+        max_x = min(max(max(v.p1[0],v.p2[0]),v.p3[0]),(float)w);
+        max_y = min(max(max(v.p1[1],v.p2[1]),v.p3[1]),(float)h);
 
-            // If the right intersection point is less than 0, then discard the scan line
-            if(x_stop<0) continue;
-            y = (int)temp[1];
+        // If the maximum coordinates are out of the plane leave the face out
+        if((max_x < 0.0) || (max_y < 0.0)) continue;
 
-            // Get interpolated depth and normal values from the values at the vertex
-            pt_stop = interp_pt_z(normals[temp[2]],normals[temp[3]],homo_coord[temp[2]],homo_coord[temp[3]],
-                    temp[0],temp[1]);
+        // Estimate bounding box using the minimum and maximum pixel values
+        temp.x = min_x;
+        temp.y = min_y;
+        temp.w = max_x - min_x;
+        temp.h = max_y - min_y;
+        bboxes.push_back(temp);
 
-            // Store start vector
-            p_stop = vec4((int)temp[0],(int)temp[1],pt_stop.z,1);
+        // Move the face down over the removed ones
+        if(kept != i) pix_triangles[kept] = v;
+        kept++;
 
-            // Store position of the start point (may not be equal to the start vector xy value)
-            stop = (y*w) + (x_stop);
+    }
 
-            count = 0;
+    // Drop the faces left over at the end (keeps the memory for the next frame)
+    pix_triangles.resize(kept);
 
-            //Loop to assign pixel value of the row from the start point to the stop point
-            for (pixel_t *p = (img->data + start); p <= (img->data + stop); p++) {
+}
 
-                // Get interpolated depth and normal values from the values at the vertex
-                pt_cur = interp_pt_z(pt_start.norm,pt_stop.norm,p_start, p_stop, x_start + count, y);
-                count ++;
 
-                // If the depth is within range and lower than current depth value in the buffer update the pixel color and the Z-buffer
-                if((pt_cur.z<z[p-(img->data)]) && (pt_cur.z>0) && (pt_cur.z<1)){
-                    z[p-(img->data)] = pt_cur.z;
-                    color = get_color(color,pt_cur.norm);
-                    p->r = color[0];
-                    p->g = color[1];
-                    p->b = color[2];
-                }
-            }
-        }
+// Set up the edge functions of a triangle for walking the pixels inside the clip window
+bool edge_setup(edge_walk &e, face &f, rect clip, bool any_sample){
+
+    // Order the vertices so that all three edge functions are positive inside the triangle.
+    // Twice the signed area is exact on the fixed point grid. Degenerate triangles do not cover any pixel.
+    fx_pt v[3] = {f.s1, f.s2, f.s3};
+    long long area = ((long long)(v[1].x - v[0].x) * (v[2].y - v[0].y)) - ((long long)(v[1].y - v[0].y) * (v[2].x - v[0].x));
+    if(area == 0) return false;
+    if(area < 0) swap(v[1], v[2]);
+
+    // Find the pixels whose centers lie in the bounding box of the triangle and the clip window.
+    // The center of pixel x is at x * FX_ONE + FX_ONE / 2 on the fixed point grid.
+    int min_x = min(min(v[0].x, v[1].x), v[2].x);
+    int max_x = max(max(v[0].x, v[1].x), v[2].x);
+    int min_y = min(min(v[0].y, v[1].y), v[2].y);
+    int max_y = max(max(v[0].y, v[1].y), v[2].y);
+
+    e.x0 = max(clip.x0, (min_x - (FX_ONE / 2) + (FX_ONE - 1)) >> FX_BITS);
+    e.x1 = min(clip.x1 - 1, (max_x - (FX_ONE / 2)) >> FX_BITS);
+    e.y = max(clip.y0, (min_y - (FX_ONE / 2) + (FX_ONE - 1)) >> FX_BITS);
+    e.y1 = min(clip.y1 - 1, (max_y - (FX_ONE / 2)) >> FX_BITS);
+
+    // Multisampling: pixel x spans x * FX_ONE to x * FX_ONE + FX_ONE - 1, and any of its samples may be covered
+    if(any_sample){
+        e.x0 = max(clip.x0, min_x >> FX_BITS);
+        e.x1 = min(clip.x1 - 1, max_x >> FX_BITS);
+        e.y = max(clip.y0, min_y >> FX_BITS);
+        e.y1 = min(clip.y1 - 1, max_y >> FX_BITS);
     }
-    return img;
-}
 
-// Coloring using barycentric coordinates and perspective corrected depth
-img_t *bary_col_z(img_t *img, vector<face> &triangles, vector<corn_pts> &corner_pts, vector <float> &z){
+    if((e.x0 > e.x1) || (e.y > e.y1)) return false;
 
-    int w = img->w;
+    // Edge k goes between the two vertices other than vertex k
+    for(int k = 0; k < 3; k++){
+        fx_pt a = v[(k + 1) % 3];
+        fx_pt b = v[(k + 2) % 3];
 
-    // Initialize various container variables
-    vec4 temp;
-    int start, stop, x_start, x_stop, y;
-    pt_info pt_cur;
-    vector<unsigned int> color = {255,255,255};
-    int count;
-    face f;
+        // E(x,y) = (b.x - a.x) * (y - a.y) - (b.y - a.y) * (x - a.x)
+        long long dx = a.y - b.y;
+        long long dy = b.x - a.x;
+        e.a[k] = dx * FX_ONE;
+        e.b[k] = dy * FX_ONE;
+        e.row[k] = (dy * (((long long)e.y * FX_ONE) + (FX_ONE / 2) - a.y)) + (dx * (((long long)e.x0 * FX_ONE) + (FX_ONE / 2) - a.x));
 
-    //Loop through the number of triangles = size of corner_pts
-    for(unsigned int i = 0; i < corner_pts.size(); i++){
+        // Pixel centers exactly on an edge only belong to the triangle if it is a top or left edge.
+        // Left edges have the inside to their right and top edges are horizontal with the inside below them.
+        // Other edges need a strictly positive value, which is the same as subtracting 1 from the integer edge function.
+        if(!((dx > 0) || ((dx == 0) && (dy > 0)))) e.row[k] -= 1;
+    }
 
-        // Set f to current face
-        f = triangles[i];
+    return true;
+}
 
-        // Loop through the pairs of intersections
-        for(unsigned int j = 0; j < corner_pts[i].lef.size(); j++){
+// Find the next row of pixels covered by the triangle
+bool next_span(edge_walk &e, int &y, int &x_start, int &x_stop){
 
-            //Left intersection point in the image
-            temp = corner_pts[i].lef[j];
-            x_start = max(0,(int)round(temp[0]));
+    long long c[3];
+    bool found;
 
-            // If the left intersection point is greater than the width, then discard the scan line
-            if(x_start>=w)  continue;
-            y = (int)round(temp[1]);
+    while(e.y <= e.y1){
 
-            // Store position of the start point (may not be equal to the start vector xy value)
-            start = (y*w) + (x_start);
+        // Edge function values at the center of the first pixel of the row
+        c[0] = e.row[0];
+        c[1] = e.row[1];
+        c[2] = e.row[2];
+        found = false;
 
-            //Right intersection point in the image
-            temp = corner_pts[i].rig[j];
-            x_stop = min((int)round(temp[0]),w-1);
+        // Step along the row. A pixel is covered if its center is inside all three edges (after the fill rule bias).
+        for(int x = e.x0; x <= e.x1; x++){
 
-            // If the right intersection point is less than 0, then discard the scan line
-            if(x_stop<0) continue;
-            y = (int)round(temp[1]);
+            if((c[0] | c[1] | c[2]) >= 0){
+                if(!found) x_start = x;
+                x_stop = x;
+                found = true;
+            }
 
-            // Store position of the start point (may not be equal to the start vector xy value)
-            stop = (y*w) + (x_stop);
+            // The triangle is convex so the covered pixels of a row are contiguous
+            else if(found) break;
 
-            count = 0;
+            c[0] += e.a[0];
+            c[1] += e.a[1];
+            c[2] += e.a[2];
+        }
 
-            //Loop to assign pixel value of the row from the start point to the stop point
-            for (pixel_t *p = (img->data + start); p <= (img->data + stop); p++) {
+        // Move the edge functions down to the next row
+        y = e.y;
+        e.y++;
+        e.row[0] += e.b[0];
+        e.row[1] += e.b[1];
+        e.row[2] += e.b[2];
 
-                // Estimate the depth and normal for some point in the triangle using barycentric coordinates
-                pt_cur = interp_barypt_z(f, x_start + count, y);
+        if(found) return true;
+    }
 
-                count ++;
+    return false;
+}
 
-                // If the depth is within range and lower than current depth value in the buffer update the pixel color and the Z-buffer
-                if((pt_cur.z<z[p-(img->data)]) && (pt_cur.z>0) && (pt_cur.z<1)){
-                    z[p-(img->data)] = pt_cur.z;
-                    color = get_color(color,pt_cur.norm);
-                    p->r = color[0];
-                    p->g = color[1];
-                    p->b = color[2];
-                }
-            }
-        }
-    }
-    return img;
+// Specialization of span_fill for a shader policy and a pass
+template <class S>
+static shade_fn shader_pass(fill_pass pass){
+    if(pass == PASS_DEPTH) return span_fill<S, PASS_DEPTH>;
+    if(pass == PASS_SHADE) return span_fill<S, PASS_SHADE>;
+    if(pass == PASS_VIS) return span_fill<S, PASS_VIS>;
+    if(pass == PASS_MSAA) return sample_fill<S, PASS_MSAA>;
+    if(pass == PASS_SUPER) return sample_fill<S, PASS_SUPER>;
+    return span_fill<S, PASS_COLOR>;
 }
 
-// Interpolate Z values (incorrect way)
-float interp_z(vec4 p1, vec4 p2, float x, float y){
-    float z;
-    float alp;
+// Pick the specialization of span_fill for a shading option and a pass
+shade_fn get_shader(char *opt, fill_pass pass){
 
-    //Estimate alpha
-    if(p1[1] == p2[1]){
+    // Check the option and return the matching shader
+    if((opt == NULL) || (strcmp (opt, "--default") == 0)){
+        return shader_pass<material_shader>(pass);
+    }
+    else if (strcmp (opt, "--white") == 0) {
+        return shader_pass<white_shader>(pass);
+    }
+    else if (strcmp (opt, "--norm_flat") == 0) {
+        return shader_pass<flat_shader>(pass);
+    }
+    else if (strcmp (opt, "--norm_gouraud") == 0) {
+        return shader_pass< normal_shader<false, false> >(pass);
+    }
+    else if (strcmp (opt, "--norm_bary") == 0) {
+        return shader_pass< normal_shader<true, false> >(pass);
+    }
+    else if (strcmp (opt, "--norm_gouraud_z") == 0) {
+        return shader_pass< normal_shader<false, true> >(pass);
+    }
+    else if (strcmp (opt, "--norm_bary_z") == 0) {
+        return shader_pass< normal_shader<true, true> >(pass);
+    }
 
-        //Check if the points are not equal
-        if(p1[0] == p2[0]){alp = 1;}
+    return NULL;
+}
 
-        else{alp = (float)(x-p1[0]) / (float) (p2[0] - p1[0]);}
+// Pick the specialization of resolve_fill for a shading option
+resolve_fn get_resolver(char *opt){
 
-//        if (alp<0){cout<<"error";}
+    if((opt == NULL) || (strcmp (opt, "--default") == 0)){
+        return resolve_fill<material_shader>;
     }
-    else{
-
-        alp = (float)(sqrt(pow((x-p1[0]),2.0)+pow((y-p1[1]),2.0)))/ (float)(sqrt(pow((p2[0]-p1[0]),2.0)+pow((p2[1]-p1[1]),2.0)));
-
+    else if (strcmp (opt, "--white") == 0) {
+        return resolve_fill<white_shader>;
+    }
+    else if (strcmp (opt, "--norm_flat") == 0) {
+        return resolve_fill<flat_shader>;
+    }
+    else if (strcmp (opt, "--norm_gouraud") == 0) {
+        return resolve_fill< normal_shader<false, false> >;
+    }
+    else if (strcmp (opt, "--norm_bary") == 0) {
+        return resolve_fill< normal_shader<true, false> >;
+    }
+    else if (strcmp (opt, "--norm_gouraud_z") == 0) {
+        return resolve_fill< normal_shader<false, true> >;
+    }
+    else if (strcmp (opt, "--norm_bary_z") == 0) {
+        return resolve_fill< normal_shader<true, true> >;
     }
 
-    // Use alpha to find interpolated depth
-    z = ((1-alp)*(float)p1[2]) + ((alp)*(float)p2[2]);
-
-    return z;
+    return NULL;
 }
 
-// Interpolate point normal and depth values (incorrect way)
-pt_info interp_pt(vec4 n1, vec4 n2, vec4 p1, vec4 p2, float x, float y){
-
-    pt_info pt;
-    float alp;
+// Set up the plane equations of the attributes of a triangle
+void tri_plane_setup(tri_setup &s, face &f, int x0, int y0){
+
+    // Offsets of points 2 and 3 from point 1 and twice the signed area of the triangle
+    float x2 = f.p2[0] - f.p1[0];
+    float y2 = f.p2[1] - f.p1[1];
+    float x3 = f.p3[0] - f.p1[0];
+    float y3 = f.p3[1] - f.p1[1];
+    float area = (x2 * y3) - (x3 * y2);
+
+    // For an attribute with values a1, a2 and a3 at the 3 points:
+    //   da/dx = ((a2 - a1) * y3 - (a3 - a1) * y2) / area
+    //   da/dy = ((a3 - a1) * x2 - (a2 - a1) * x3) / area
+    // Degenerate triangles get flat planes
+    float gx2 = 0, gx3 = 0, gy2 = 0, gy3 = 0;
+    if(area != 0){
+        gx2 = y3 / area;
+        gx3 = -y2 / area;
+        gy2 = -x3 / area;
+        gy3 = x2 / area;
+    }
 
-    // Find alpha
-    if(p1[1] == p2[1]){
+    // Offset of the center of pixel (x0, y0) from point 1
+    float px = (x0 + 0.5) - f.p1[0];
+    float py = (y0 + 0.5) - f.p1[1];
+    s.x0 = x0;
+    s.y0 = y0;
+
+    // Depth
+    s.dzdx = ((f.p2[2] - f.p1[2]) * gx2) + ((f.p3[2] - f.p1[2]) * gx3);
+    s.dzdy = ((f.p2[2] - f.p1[2]) * gy2) + ((f.p3[2] - f.p1[2]) * gy3);
+    s.z = f.p1[2] + (s.dzdx * px) + (s.dzdy * py);
+
+    // 1/w (stored in the 4th coordinate of the points)
+    s.diwdx = ((f.p2[3] - f.p1[3]) * gx2) + ((f.p3[3] - f.p1[3]) * gx3);
+    s.diwdy = ((f.p2[3] - f.p1[3]) * gy2) + ((f.p3[3] - f.p1[3]) * gy3);
+    s.iw = f.p1[3] + (s.diwdx * px) + (s.diwdy * py);
+
+    // Normal
+    s.dndx = ((f.n2 - f.n1) * gx2) + ((f.n3 - f.n1) * gx3);
+    s.dndy = ((f.n2 - f.n1) * gy2) + ((f.n3 - f.n1) * gy3);
+    s.n = f.n1 + (s.dndx * px) + (s.dndy * py);
+
+    // Normal/w
+    vec4 nw1 = f.n1 * f.p1[3];
+    vec4 nw2 = f.n2 * f.p2[3];
+    vec4 nw3 = f.n3 * f.p3[3];
+    s.dnwdx = ((nw2 - nw1) * gx2) + ((nw3 - nw1) * gx3);
+    s.dnwdy = ((nw2 - nw1) * gy2) + ((nw3 - nw1) * gy3);
+    s.nw = nw1 + (s.dnwdx * px) + (s.dnwdy * py);
+}
 
-        //Check if the points are not equal
-        if(p1[0] == p2[0]){alp = 1;}
+// Value of a plane equation dx pixels to the right and dy pixels below its reference pixel
+float plane_at(float a, float dadx, float dady, int dx, int dy){
+    return a + (dadx * dx) + (dady * dy);
+}
 
-        else{alp = (float)(x-p1[0]) / (float) (p2[0] - p1[0]);}
+vec4 plane_at(const vec4 &a, const vec4 &dadx, const vec4 &dady, int dx, int dy){
+    return a + (dadx * dx) + (dady * dy);
+}
 
-//        if (alp<0){cout<<"error";}
+// Get color from normal value
+void get_color(unsigned int *color, const vec4 &normal){
 
-    }
-    else{
+    for(unsigned int i = 0; i<3; i++){
 
-        alp = (float)(sqrt(pow((x-p1[0]),2.0)+pow((y-p1[1]),2.0)))/ (float)(sqrt(pow((p2[0]-p1[0]),2.0)+pow((p2[1]-p1[1]),2.0)));
+        // Since the normal ranges from -1 to 1 add 1 and half it before scaling to 255
+        color[i] = (unsigned int) round((normal[i]+1)*0.5*255.0);
 
     }
-
-    //Find interpolated normal and depth values using alpha
-    pt.norm = ((1-alp)*n1) + ((alp)*n2);
-    pt.z = ((1-alp)*(float)p1[2]) + ((alp)*(float)p2[2]);
-
-    return pt;
 }
 
-// Interpolate point normal and depth values (correct way)
-pt_info interp_pt_z(vec4 n1, vec4 n2, vec4 p1, vec4 p2, float x, float y){
-    pt_info pt;
-    float alp;
-    float eps = 0.0001;
+// Get triangle area
+float t_area(vec4 p1, vec4 p2, vec4 p3){
 
-    // Find alpha value
-    if(p1[1] == p2[1]){
+    //Estimate the area made by 3 points by talking the half of the cross product of the 2 vectors made by the three points
+    float v1x,v2x,v1y,v2y;
+    v1x = p1[0] - p2[0];
+    v1y = p1[1] - p2[1];
+    v2x = p3[0] - p2[0];
+    v2y = p3[1] - p2[1];
+    return 0.5*((v1x*v2y) - (v2x*v1y));
+}
 
-        //Check if the points are not equal
-        if(p1[0] == p2[0]){alp = 1;}
+// Twice the signed area of a triangle on the fixed point grid
+long long t_area_fx(fx_pt s1, fx_pt s2, fx_pt s3){
+    return ((long long)(s1.x - s2.x) * (s3.y - s2.y)) - ((long long)(s3.x - s2.x) * (s1.y - s2.y));
+}
 
-        else{alp = (float)(x-p1[0]) / (float) (p2[0] - p1[0]);}
+// Reset all the counters to 0
+void clear_stats(render_stats &stats){
+    memset(&stats, 0, sizeof(stats));
+}
 
-//        if (alp<0){cout<<"error";}
+// Print the counters
+void print_stats(const render_stats &stats){
+    printf("Triangles: %zu\n", stats.triangles);
+    printf("  culled (outside the view frustum): %zu\n", stats.culled_frustum);
+    printf("  clipped (near plane or guard band): %zu\n", stats.clipped);
+    printf("  culled (facing): %zu\n", stats.culled_facing);
+    printf("  culled (zero area): %zu\n", stats.culled_zero_area);
+    printf("  culled (no pixel center): %zu\n", stats.culled_no_sample);
+    printf("  drawn (including pieces of clipped triangles): %zu\n", stats.drawn);
+    printf("Hierarchical Z rejected:\n");
+    printf("  triangles: %zu of %zu (%.1f%%)\n", stats.hiz_culled_triangles, stats.hiz_triangles,
+           stats.hiz_triangles ? (100.0 * stats.hiz_culled_triangles / stats.hiz_triangles) : 0.0);
+    printf("  spans: %zu of %zu (%.1f%%)\n", stats.hiz_culled_spans, stats.hiz_spans,
+           stats.hiz_spans ? (100.0 * stats.hiz_culled_spans / stats.hiz_spans) : 0.0);
+    printf("Pixels:\n");
+    printf("  depth tested: %zu\n", stats.pixels_tested);
+    printf("  shaded: %zu\n", stats.pixels_shaded);
+    printf("  visible: %zu\n", stats.pixels_visible);
+    printf("  overdraw (shaded per visible pixel): %.2f\n",
+           stats.pixels_visible ? ((double)stats.pixels_shaded / stats.pixels_visible) : 0.0);
+    printf("Adaptive supersampling:\n");
+    printf("  pixels refined: %zu (%.1f%% of the visible ones)\n", stats.pixels_refined,
+           stats.pixels_visible ? (100.0 * stats.pixels_refined / stats.pixels_visible) : 0.0);
+    printf("  samples shaded: %zu\n", stats.samples_shaded);
+}
 
+// Resize the framebuffer, set every depth to 2 and every color to black. The vectors keep their memory between frames.
+void clear_z(z_buffer &zb, int w, int h, bool vis, int samples){
+    zb.w = w;
+    zb.h = h;
+    zb.samples = samples;
+    zb.slot.clear();
+    zb.blocks_x = (w + HIZ_SIZE - 1) / HIZ_SIZE;
+    int n_blocks = zb.blocks_x * ((h + HIZ_SIZE - 1) / HIZ_SIZE);
+
+    // Whole blocks, plus room to move the start to a cache line boundary
+    fb_pixel clear = {2.0, 0, 0, 0, 0};
+    size_t n_pixels = (size_t)n_blocks * HIZ_SIZE * HIZ_SIZE;
+    zb.fb_mem.assign(n_pixels + (FB_ALIGN / sizeof(fb_pixel)), clear);
+    size_t misalign = (size_t)zb.fb_mem.data() % FB_ALIGN;
+    zb.fb = zb.fb_mem.data() + (misalign ? ((FB_ALIGN - misalign) / sizeof(fb_pixel)) : 0);
+
+    zb.block_max.assign(n_blocks, 2.0);
+    zb.dirty.assign(n_blocks, 0);
+    if(vis){
+        zb.tri.assign(w * h, VIS_NONE);
+        zb.shape.resize(w * h);
     }
-    else{
-
-        alp = (float)(sqrt(pow((x-p1[0]),2.0)+pow((y-p1[1]),2.0)))/ (float)(sqrt(pow((p2[0]-p1[0]),2.0)+pow((p2[1]-p1[1]),2.0)));
-
+    if(samples > 1){
+        pixel_t black = {0, 0, 0};
+        zb.sample_z.assign((size_t)w * h * samples, 2.0);
+        zb.sample_color.assign((size_t)w * h * samples, black);
     }
+}
 
-    // Estimate perspective corrected depth
-    pt.z = 1.0 / (((1-alp)/(float)p1[2]) + ((alp)/(float)p2[2]));
-
-    // Estimate new alpha if the depth values are not equal
-    if(fabs(p2[2] - p1[2])>eps){
-        alp  = ( pt.z - p1[2] ) / ( p2[2] - p1[2] );
-        cout<<alp<<endl;
+// Farthest depth of a range of blocks, recomputing the dirty ones first
+float block_max_z(z_buffer &zb, int bx0, int by0, int bx1, int by1){
+
+    float far_z = 0;
+    for(int by = by0; by <= by1; by++){
+        for(int bx = bx0; bx <= bx1; bx++){
+            int b = (by * zb.blocks_x) + bx;
+
+            // Find the farthest pixel of the block again (blocks on the right and bottom edges may be cut short).
+            // Depths written by a depth prepass are negated until their pixel is shaded.
+            if(zb.dirty[b]){
+                int nx = min(HIZ_SIZE, zb.w - (bx * HIZ_SIZE));
+                int ny = min(HIZ_SIZE, zb.h - (by * HIZ_SIZE));
+                const fb_pixel *block = &zb.fb[(size_t)b * HIZ_SIZE * HIZ_SIZE];
+                float m = 0;
+                for(int y = 0; y < ny; y++){
+                    const fb_pixel *row = block + (y * HIZ_SIZE);
+                    for(int x = 0; x < nx; x++){
+                        m = max(m, (float)fabs(row[x].z));
+                    }
+                }
+                zb.block_max[b] = m;
+                zb.dirty[b] = 0;
+            }
+            far_z = max(far_z, zb.block_max[b]);
+        }
     }
-
-//    if (alp<0){cout<<"error";}
-
-    // Estimate the interpolated normal value using the perspective corrected depth
-    pt.norm = pt.z*((1-alp)*n1/(float)p1[2]) + ((alp)*n2/(float)p2[2]);
-
-    return pt;
+    return far_z;
 }
 
-// Interpolate point normal and depth values using barycentric(incorrect way)
-pt_info interp_barypt(face f, float x, float y){
-    pt_info pt;
-    float S, S1, S2, S3;
+// Whether two neighbouring pixels are different enough to refine them
+static bool refine_pair(const fb_pixel &a, const fb_pixel &b, float threshold){
 
-    // Estimate the 4 areas required to estimate the barycentric coordinates
-    S  = t_area(f.p1,f.p2,f.p3);
-    S1  = t_area(vec4(x,y,0,1),f.p2,f.p3);
-    S2  = t_area(vec4(x,y,0,1),f.p3,f.p1);
-    S3  = t_area(vec4(x,y,0,1),f.p1,f.p2);
+    // Silhouette: only one of them is covered
+    float zp = a.z, zq = b.z;
+    if((zp < 1) != (zq < 1)) return true;
+    if(zp >= 1) return false;
 
-    //Find the interpolated depth and normal values using the barycentric coordinates
-    pt.norm = f.n1*(S1/S) + f.n2*(S2/S) + f.n3*(S3/S);
-    pt.z = (float)f.p1[2]*(S1/S) + (float)f.p2[2]*(S2/S) + (float)f.p3[2]*(S3/S);
-    return pt;
+    // Color contrast
+    int limit = (int)(threshold * 255);
+    if((abs(a.r - b.r) > limit) || (abs(a.g - b.g) > limit) || (abs(a.b - b.b) > limit)) return true;
 
+    // Depth discontinuity relative to the distance to the eye
+    return fabs(zp - zq) > (threshold * (1 - min(zp, zq)));
 }
 
-// Interpolate point normal and depth values using barycentric(correct way)
-pt_info interp_barypt_z(face f, float x, float y){
-    pt_info pt;
-    float S, S1, S2, S3;
-
-    // Estimate the 4 areas required to estimate the barycentric coordinates
-    S  = t_area(f.p1,f.p2,f.p3);
-    S1  = t_area(vec4(x,y,0,1),f.p2,f.p3);
-    S2  = t_area(vec4(x,y,0,1),f.p3,f.p1);
-    S3  = t_area(vec4(x,y,0,1),f.p1,f.p2);
-
-    //Estimate the perspective corrected depth using barycentric coordinates
-    pt.z = 1.0 / (((S1/S)/(float)f.p1[2]) + ((S2/S)/(float)f.p2[2]) + ((S3/S)/(float)f.p3[2]));
+// Pick the pixels worth refining with adaptive supersampling and give them samples
+size_t refine_pixels(z_buffer &zb, float threshold, int samples){
+
+    int w = zb.w, h = zb.h;
+    zb.samples = samples;
+    zb.slot.assign((size_t)w * h, VIS_NONE);
+
+    // Compare every pixel with the one to its right and the one below it, and mark both when they differ.
+    // The samples of the marked pixels are then numbered in order.
+    for(int y = 0; y < h; y++){
+        for(int x = 0; x < w; x++){
+            size_t p = ((size_t)y * w) + x;
+            const fb_pixel &a = zb.fb[fb_index(zb, x, y)];
+            if((x + 1 < w) && refine_pair(a, zb.fb[fb_index(zb, x + 1, y)], threshold)) zb.slot[p] = zb.slot[p + 1] = 0;
+            if((y + 1 < h) && refine_pair(a, zb.fb[fb_index(zb, x, y + 1)], threshold)) zb.slot[p] = zb.slot[p + w] = 0;
+        }
+    }
+    size_t n = 0;
+    for(size_t p = 0; p < zb.slot.size(); p++){
+        if(zb.slot[p] != VIS_NONE) zb.slot[p] = n++;
+    }
 
-    //Use the perspective corrected depth to estimate normal values
-    pt.norm = pt.z*((f.n1*(S1/S)/f.p1[2]) + (f.n2*(S2/S)/f.p2[2]) + (f.n3*(S3/S)/f.p3[2]));
-    return pt;
+    pixel_t black = {0, 0, 0};
+    zb.sample_z.assign(n * samples, 2.0);
+    zb.sample_color.assign(n * samples, black);
+    return n;
 }
 
-// Get color from normal value
-vector <unsigned int> get_color(vector <unsigned int> &color, vec4 normal){
-
-    for(unsigned int i = 0; i<3; i++){
-
-        // Since the normal ranges from -1 to 1 add 1 and half it before scaling to 255
-        color[i] = (unsigned int) round((normal[i]+1)*0.5*255.0);
+// Average the samples of every pixel inside clip that has samples into its color
+void resolve_samples(z_buffer &zb, rect clip){
+
+    int n = zb.samples;
+    for(int y = clip.y0; y < clip.y1; y++){
+        for(int x = clip.x0; x < clip.x1; x++){
+            unsigned int slot = sample_slot(zb, ((size_t)y * zb.w) + x);
+            if(slot == VIS_NONE) continue;
+            const pixel_t *c = &zb.sample_color[(size_t)slot * n];
+
+            // Samples no triangle covered are black, which fades the edges against the background
+            unsigned int r = 0, g = 0, b = 0;
+            for(int k = 0; k < n; k++){
+                r += c[k].r;
+                g += c[k].g;
+                b += c[k].b;
+            }
+            fb_pixel &q = zb.fb[fb_index(zb, x, y)];
+            q.r = (r + (n / 2)) / n;
+            q.g = (g + (n / 2)) / n;
+            q.b = (b + (n / 2)) / n;
+        }
+    }
+}
 
+// Copy the colors of the pixels inside clip from the tiled framebuffer to the row-major image
+void pack_img(img_t *img, const z_buffer &zb, rect clip){
+
+    // Each row of the clip window goes through the blocks it crosses, HIZ_SIZE contiguous pixels at a time
+    for(int y = clip.y0; y < clip.y1; y++){
+        pixel_t *dst = img->data + ((size_t)y * img->w) + clip.x0;
+        for(int x0 = clip.x0; x0 < clip.x1; x0 = (x0 / HIZ_SIZE + 1) * HIZ_SIZE){
+            int n = min((x0 / HIZ_SIZE + 1) * HIZ_SIZE, clip.x1) - x0;
+            const fb_pixel *src = &zb.fb[fb_index(zb, x0, y)];
+            for(int k = 0; k < n; k++, dst++){
+                dst->r = src[k].r;
+                dst->g = src[k].g;
+                dst->b = src[k].b;
+            }
+        }
     }
-    return color;
 }
 
-// Get triangle area
-float t_area(vec4 p1, vec4 p2, vec4 p3){
+// Copy the colors of the pixels inside clip from the tiled framebuffer to a 32-bit image
+void pack_img(img32_t &img, const z_buffer &zb, rect clip){
 
-    //Estimate the area made by 3 points by talking the half of the cross product of the 2 vectors made by the three points
-    float v1x,v2x,v1y,v2y;
-    v1x = p1[0] - p2[0];
-    v1y = p1[1] - p2[1];
-    v2x = p3[0] - p2[0];
-    v2y = p3[1] - p2[1];
-    return 0.5*((v1x*v2y) - (v2x*v1y));
+    for(int y = clip.y0; y < clip.y1; y++){
+        unsigned int *dst = img.data + ((size_t)y * img.stride) + clip.x0;
+        for(int x0 = clip.x0; x0 < clip.x1; x0 = (x0 / HIZ_SIZE + 1) * HIZ_SIZE){
+            int n = min((x0 / HIZ_SIZE + 1) * HIZ_SIZE, clip.x1) - x0;
+            const fb_pixel *src = &zb.fb[fb_index(zb, x0, y)];
+            for(int k = 0; k < n; k++, dst++){
+                *dst = 0xff000000u | ((unsigned int)src[k].r << 16) | ((unsigned int)src[k].g << 8) | src[k].b;
+            }
+        }
+    }
 }
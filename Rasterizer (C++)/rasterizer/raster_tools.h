@@ -17,6 +17,13 @@ struct img_t {
   int w, h; // image width and height
 };
 
+/// 32-bit image owned by the caller, such as the pixels of a QImage::Format_RGB32 (0xffRRGGBB per pixel)
+struct img32_t{
+  unsigned int *data; // First pixel of the first row
+  int w, h; // Width and height
+  int stride; // Pixels from the start of a row to the start of the next one (at least w)
+};
+
 /// Camera matrices that govern the projection
 struct cam_dat{
     mat4 proj_mat; // Projection matrix
@@ -25,16 +32,186 @@ struct cam_dat{
     mat4 per_mat; // Perspective matrix = proj_mat*rot_mat*trans_mat
 };
 
+/// Number of fractional bits in the fixed point (28.4) pixel coordinates, i.e. vertices snap to 1/16th of a pixel
+#define FX_BITS 4
+#define FX_ONE (1 << FX_BITS)
+
+/// Largest distance (in pixels) of a snapped vertex from the image origin. Keeps the edge functions inside 64 bits.
+#define FX_LIMIT (1 << 22)
+
+/// Outcode bits of a vertex in clip space (x, y, z, w). The view frustum is -w <= x <= w, -w <= y <= w and 0 <= z <= w.
+#define CLIP_LEFT   0x01 // x < -w
+#define CLIP_RIGHT  0x02 // x > w
+#define CLIP_BOTTOM 0x04 // y < -w
+#define CLIP_TOP    0x08 // y > w
+#define CLIP_NEAR   0x10 // z < 0 (includes every point behind the eye)
+#define CLIP_FAR    0x20 // z > w
+#define CLIP_GUARD  0x40 // x or y outside the guard band
+#define CLIP_FRUSTUM 0x3f // Any frustum plane
+
+/// Half width of the guard band in normalized device coordinates (the viewport spans -1 to 1).
+/// Triangles inside it are not clipped in x and y, the rasterizer just skips their pixels outside the image.
+/// Its edge must stay well inside FX_LIMIT once converted to pixels.
+#define CLIP_GUARD_BAND 8.0f
+
+/// Most vertices of a triangle after clipping against the near plane and the 4 guard band planes
+#define CLIP_MAX_VERTS 8
+
+/// Structure to store a vertex position snapped to the fixed point pixel grid
+struct fx_pt{
+  int x; // x pixel coordinate in 28.4 fixed point
+  int y; // y pixel coordinate in 28.4 fixed point
+};
+
+/// Read only view of the mesh data of a shape.
+/// Points either into a parsed tinyobj::mesh_t or straight into a memory mapped mesh cache file.
+struct mesh_view{
+  const float *positions; // n_verts packed (x, y, z) positions
+  const float *normals; // n_verts packed (x, y, z) normals (NULL if the mesh has no normal per vertex)
+  const unsigned int *indices; // n_indices vertex indices, 3 per triangle
+  const int *material_ids; // Material of each triangle (NULL if there are none)
+  size_t n_verts;
+  size_t n_indices;
+};
+
+/// Make a view of a parsed mesh
+mesh_view view_mesh(const tinyobj::mesh_t &mesh);
+
+/// Copy count triangles of a mesh starting at triangle first into out, along with only the vertices they use.
+/// used is scratch space (the sorted list of the vertices used) kept between calls so that slicing does not allocate.
+void slice_mesh(const mesh_view &mesh, size_t first, size_t count, tinyobj::mesh_t &out, vector<unsigned int> &used);
+
+/// Transformed vertices of a shape stored as a structure of arrays (one entry per vertex in each array)
+struct vert_soa{
+  vector<float> x, y; // Pixel coordinates (snapped to the fixed point grid)
+  vector<float> z; // Depth in [0,1]
+  vector<float> iw; // 1/w
+  vector<float> nx, ny, nz; // Normal in the camera frame
+  vector<fx_pt> s; // Snapped pixel coordinates used for the coverage tests
+  vector<unsigned char> clip; // Outcode against the frustum planes and the guard band (CLIP_* bits)
+};
+
 /// Structure to store triangle face data
 struct face{
-  vec4 p1; // Store x, y, and z of point 1.
-  vec4 p2; // Store x, y, and z of point 2.
-  vec4 p3; // Store x, y, and z of point 3.
+  vec4 p1; // Store x, y, z and 1/w of point 1.
+  vec4 p2; // Store x, y, z and 1/w of point 2.
+  vec4 p3; // Store x, y, z and 1/w of point 3.
   vec4 n1; // Store x, y, and z of normal of point 1.
   vec4 n2; // Store x, y, and z of normal of point 2.
   vec4 n3; // Store x, y, and z of normal of point 3.
+  fx_pt s1; // Snapped pixel coordinates of point 1.
+  fx_pt s2; // Snapped pixel coordinates of point 2.
+  fx_pt s3; // Snapped pixel coordinates of point 3.
+};
+
+/// Which triangles the culling stage removes depending on the way they face the camera
+enum cull_mode{
+  CULL_NONE,  // Keep the triangles facing either way
+  CULL_BACK,  // Remove the triangles facing away from the camera
+  CULL_FRONT  // Remove the triangles facing the camera
+};
+
+/// Pixels covered by a triangle's bounding box below which the culling stage checks exactly whether it covers a pixel center
+#define CULL_SMALL_PIXELS 4
+
+/// Counters filled in during a render
+struct render_stats{
+  size_t triangles; // Triangles in the meshes
+  size_t culled_frustum; // Removed because all their vertices are outside the same plane of the view frustum
+  size_t clipped; // Clipped against the near plane or the guard band (each piece then goes through the other tests)
+  size_t culled_facing; // Removed because of the way they face (see cull_mode)
+  size_t culled_zero_area; // Removed because their area is zero on the fixed point grid
+  size_t culled_no_sample; // Removed because they do not cover the center of any pixel of the image
+  size_t drawn; // Triangles (and pieces of clipped triangles) sent to the rasterizer
+  size_t hiz_triangles; // Triangles tested against the hierarchical Z-buffer (once per screen tile they are drawn in)
+  size_t hiz_culled_triangles; // Triangles rejected whole because they are behind every block they overlap
+  size_t hiz_spans; // Rows of pixels tested against the hierarchical Z-buffer
+  size_t hiz_culled_spans; // Rows of pixels rejected whole
+  size_t pixels_tested; // Pixels of the rows reaching the depth test
+  size_t pixels_shaded; // Pixels passing the depth test (each one is colored and written)
+  size_t pixels_visible; // Pixels of the image covered by a triangle. Overdraw is pixels_shaded / pixels_visible.
+  size_t pixels_refined; // Pixels drawn again with several samples by adaptive supersampling
+  size_t samples_shaded; // Samples of those pixels passing the depth test (each one is colored)
 };
 
+/// Reset all the counters to 0
+void clear_stats(render_stats &stats);
+
+/// Print the counters
+void print_stats(const render_stats &stats);
+
+/// Width and height in pixels of the blocks of the hierarchical Z-buffer (divides TILE_SIZE)
+#define HIZ_SIZE 8
+
+/// Marks a pixel of the visibility buffer where no triangle was drawn
+#define VIS_NONE 0xffffffffu
+
+/// Largest number of samples per pixel when multisampling
+#define MSAA_MAX_SAMPLES 8
+
+/// Samples per refined pixel in adaptive supersampling
+#define ADAPTIVE_SAMPLES 8
+
+/// Default contrast above which adaptive supersampling refines a pixel (see refine_pixels)
+#define ADAPTIVE_THRESHOLD 0.1f
+
+/// A pixel of the tiled framebuffer: its depth next to its color, so that a span reads and writes both in the same cache line.
+/// At 8 bytes a HIZ_SIZE x HIZ_SIZE block of pixels fills whole cache lines and every store is aligned.
+struct fb_pixel{
+  float z; // Depth (negated between the two passes of a depth prepass, see span_fill)
+  unsigned char r, g, b, a; // Color (a is only padding)
+};
+
+/// Alignment in bytes of the tiled framebuffer (a cache line)
+#define FB_ALIGN 64
+
+/// Framebuffer used while rasterizing: the depth and color of every pixel stored block by block, HIZ_SIZE x HIZ_SIZE
+/// pixels per block (row by row inside a block), along with a coarse level keeping the farthest depth of every block.
+/// pack_img copies the colors to the row-major image at the end (or to a 32-bit image). It can also keep which triangle is visible at every pixel (the visibility buffer of deferred shading).
+/// When multisampling it keeps the depth and color of every sample, and the depth of a pixel is its farthest sample.
+/// Adaptive supersampling only gives samples to some pixels, listed in slot.
+/// Drawing only brings depths nearer, so the stored farthest depth of a block is never nearer than the real one
+/// and is only recomputed when it is needed again. Anything not nearer than it fails the depth test in the whole block.
+struct z_buffer{
+  vector<fb_pixel> fb_mem; // Storage of the framebuffer, with room to align it
+  fb_pixel *fb; // Depth and color of every pixel, in blocks (see fb_index) and aligned to FB_ALIGN
+  vector<float> block_max; // Farthest depth of each block (conservative)
+  vector<unsigned char> dirty; // Blocks written since their farthest depth was computed
+  vector<unsigned int> tri; // Index of the triangle visible at every pixel, row by row (VIS_NONE if none). Only written by the visibility pass.
+  vector<unsigned int> shape; // Shape of that triangle
+  vector<float> sample_z; // Depth of every sample, the samples of a pixel being next to each other. Only used when multisampling.
+  vector<pixel_t> sample_color; // Color of every sample (same layout)
+  vector<unsigned int> slot; // Position of the samples of every pixel in units of samples (VIS_NONE if it has none). Empty when every pixel has samples.
+  int samples; // Samples per pixel (1 unless multisampling)
+  int w, h; // Size in pixels
+  int blocks_x; // Number of blocks along the width
+};
+
+/// Position of pixel (x, y) in the tiled framebuffer. The blocks on the right and bottom edges are padded to full size.
+inline size_t fb_index(const z_buffer &zb, int x, int y){
+  return ((size_t)(((y / HIZ_SIZE) * zb.blocks_x) + (x / HIZ_SIZE)) * (HIZ_SIZE * HIZ_SIZE)) + ((y % HIZ_SIZE) * HIZ_SIZE) + (x % HIZ_SIZE);
+}
+
+/// Resize the framebuffer to w x h, set every depth to 2 (behind everything) and every color to black.
+/// With vis the visibility buffer is also sized and cleared to VIS_NONE (it is left alone otherwise).
+/// With more than one sample per pixel the sample depths are set to 2 as well and the sample colors to black.
+void clear_z(z_buffer &zb, int w, int h, bool vis = false, int samples = 1);
+
+/// Farthest depth of the blocks from (bx0, by0) to (bx1, by1) inclusive. Dirty blocks are recomputed first.
+float block_max_z(z_buffer &zb, int bx0, int by0, int bx1, int by1);
+
+/// Where the samples of pixel p start in sample_z and sample_color in units of samples (VIS_NONE if it has none)
+inline unsigned int sample_slot(const z_buffer &zb, size_t p){
+  return zb.slot.empty() ? (unsigned int)p : zb.slot[p];
+}
+
+/// Pick the pixels of the framebuffer worth refining with adaptive supersampling and give them samples samples each
+/// in zb (cleared to nothing drawn). A pixel is refined when a neighbour (left, right, above or below) is on the other
+/// side of a silhouette (one of them is background), when a color channel changes by more than threshold * 255
+/// (material edges, and normal changes in the normal modes), or when the depth jumps by more than the fraction
+/// threshold of the distance to the eye (1 - z is close to proportional to 1 / distance). Returns the number of pixels picked.
+size_t refine_pixels(z_buffer &zb, float threshold, int samples);
+
 /// Structure to store bounding box info
 struct bbox{
   float x; // Top Left x
@@ -43,27 +220,38 @@ struct bbox{
   float h; // Height of box
 };
 
-/// Structure to store edge intersection info in a particular bbox ((x,y) pixels data , depth and apended by 1 at the end)
-struct corn_pts{
-  vector <vec4> lef;//Contains info about x y pixel coordinates of left intersection and index of the points that created it.
-  vector <vec4> rig;//Contains info about x y pixel coordinates of right intersection and index of the points that created it.
+/// Structure to store a clipping window in pixels (x0, y0 inclusive and x1, y1 exclusive)
+struct rect{
+  int x0; // Left column
+  int y0; // Top row
+  int x1; // One past the right column
+  int y1; // One past the bottom row
 };
 
-/// Structure to store line data
-struct line_dat{
-  vec4 p1; //Point one (with smaller x coordinate)
-  vec4 p2; //Point two (with larger x coordinate)
-  float m; //Slope
+/// Structure to walk over the pixels covered by a triangle using incremental edge functions
+/// The edge functions are evaluated exactly on the snapped fixed point coordinates.
+struct edge_walk{
+  long long a[3]; // Change in each edge function for a step of one pixel along x
+  long long b[3]; // Change in each edge function for a step of one pixel along y
+  long long row[3]; // Value of each edge function at the center of the first pixel of the current row (minus the fill rule bias)
+  int x0, x1; // First and last column of pixels to test
+  int y, y1; // Current and last row of pixels to test
 };
 
-/// Structure to store color and depth info
-struct pt_info{
-    vec4 norm; // Normal data for a point (used to determine the color of the pixel)
-    float z; // Depth of a point
+/// Structure to store the plane equations of the attributes of a triangle.
+/// Each attribute is given at the center of a reference pixel along with its change for a step of one pixel along x and y,
+/// so walking along a row only needs additions.
+struct tri_setup{
+  float z, dzdx, dzdy; // Depth
+  float iw, diwdx, diwdy; // 1/w (for perspective correction)
+  vec4 n, dndx, dndy; // Normal
+  vec4 nw, dnwdx, dnwdy; // Normal divided by w (for perspective correction)
+  int x0, y0; // Reference pixel
 };
 
 /// Initialize Image handler functions
 img_t *new_img(int w, int h);  // create a new image of specified width and height
+img_t *copy_img(const img_t *img); // make a copy of an image
 void destroy_img(img_t **img); // delete img from memory
 img_t *read_ppm(const char *fname); // read in an image in ppm format
 void  write_ppm(const img_t *img, const char *fname); // write an image in ppm format
@@ -71,64 +259,74 @@ void  write_ppm(const img_t *img, const char *fname); // write an image in ppm f
 /// Read camera file and generate camera data
 cam_dat get_permat(char *cam_file);
 
-/// Accumulate the triangles using the shape information in the model files and make a vector of triangles
-vector<face> world_to_im(tinyobj::shape_t &shapes, vector <vec4> &homo_coord, vector <vec4> &normals);
+/// Generate camera data from the 15 camera parameters (left, right, top, bottom, near, far, eye, center and up)
+cam_dat get_permat(float *params);
 
-/// Given the pixels of triangle vertices find the bounding box for each of them
-vector<bbox> get_bbox(vector<face> &pix_triangles, int w, int h);
+/// Snap pixel coordinates to the fixed point grid
+fx_pt snap_pt(float x, float y);
 
-/// Scan along each row and find left and right edge intersections.
-vector<corn_pts> get_corners(vector<face> &pix_triangle, vector<bbox> &bboxes);
+/// Positions of the samples of the n sample pattern (n = 2, 4 or 8) in 1/FX_ONE of a pixel from the pixel center.
+/// These are the standard rotated grid patterns, which stay within the pixel. Returns NULL for other counts.
+const fx_pt *msaa_pattern(int n);
 
-/// Filling the image points using intersection points and color value derived dependent on the option given
-img_t *fill_img(img_t *img, vector<face> triangles, vector<corn_pts> &corner_pts,
-                tinyobj::material_t &materials, vector <float> &z,  vector <vec4> &homo_coord, vector <vec4> &normals,
-                char *opt);
+/// Clip space outcode (CLIP_* bits) of a point
+unsigned char clip_code(float x, float y, float z, float w);
 
-/// Coloring using the diffuse property in the materials object
-img_t *default_col(img_t *img, vector<corn_pts> &corner_pts, tinyobj::material_t &materials,
-                   vector<float> &z, vector <vec4> &homo_coord);
+/// Accumulate the triangles using the shape information in the model files into the vector of triangles.
+/// This is also the clipping and culling stage: triangles outside the view frustum are rejected using the outcodes
+/// of their vertices, the ones crossing the near plane or the guard band are clipped in clip space (using cam), and
+/// the ones facing the way removed by cull, with no area or that do not cover any pixel center of the w x h image
+/// are left out. Everything is counted in stats. When multisampling (samples > 1) only the triangles that do not
+/// overlap any pixel are left out, since the others may cover a sample away from the center.
+void world_to_im(mesh_view &mesh, vert_soa &verts, vector<face> &triangles, cam_dat &cam, int w, int h,
+                 cull_mode cull, render_stats &stats, int samples = 1);
 
-/// Coloring all the pixels in the triangle white
-img_t *white_col(img_t *img, vector<corn_pts> &corner_pts, vector <float> &z, vector<vec4> &homo_coord);
+/// Number of depth buckets used to sort the triangles front to back
+#define SORT_DEPTH_BUCKETS 4096
 
-/// Coloring each face with a single color derived from the first vertex index in the face
-img_t *flat_col(img_t *img, vector <face> &triangles, vector<corn_pts> &corner_pts, vector <float> &z,
-                 vector <vec4> &homo_coord);
+/// Depth of the nearest vertex of a triangle
+float near_z(const face &f);
 
-/// Coloring using gouraud shading
-img_t *gouraud_col(img_t *img, vector<corn_pts> &corner_pts, vector <float> &z,
-                 vector <vec4> &homo_coord, vector <vec4> &normals);
+/// Sort the triangles coarsely front to back by the depth of their nearest vertex, so that the nearer ones fill the Z-buffer first.
+/// This is a stable counting sort over SORT_DEPTH_BUCKETS buckets spread between the nearest and the farthest triangle.
+/// scratch (a copy of the triangles) and first (the bucket positions) are only working space. Keep them between calls so
+/// that sorting does not allocate once they have grown to the largest shape.
+void sort_front_to_back(vector<face> &triangles, vector<face> &scratch, vector<size_t> &first);
 
-/// Coloring using barycentric shading
-img_t *bary_col(img_t *img, vector<face> &triangles, vector<corn_pts> &corner_pts, vector <float> &z);
+/// Given the pixels of triangle vertices find the bounding box for each of them.
+/// Faces outside the image are removed from pix_triangles in one pass (the others keep their order), so bboxes[i] belongs to pix_triangles[i].
+void get_bbox(vector<face> &pix_triangles, int w, int h, vector<bbox> &bboxes);
 
-/// Coloring using gouraud shading but with perspective corrected Z
-img_t *gouraud_col_z(img_t *img, vector<corn_pts> &corner_pts, vector <float> &z,
-                 vector <vec4> &homo_coord, vector <vec4> &normals);
+/// Set up the edge functions of a triangle for walking the pixels inside clip. Returns false if no pixel can be covered.
+/// With any_sample the pixels walked are all the ones overlapping the bounding box of the triangle (for multisampling)
+/// rather than the ones whose center is inside it. The edge functions are still given at the pixel centers.
+bool edge_setup(edge_walk &e, face &f, rect clip, bool any_sample = false);
 
-/// Coloring using barycentric shading but with perspective corrected Z
-img_t *bary_col_z(img_t *img, vector<face> &triangles, vector<corn_pts> &corner_pts, vector <float> &z);
+/// Find the next row of pixels covered by the triangle. Returns false once all the rows have been walked.
+bool next_span(edge_walk &e, int &y, int &x_start, int &x_stop);
 
-/// Interpolate Z values
-float interp_z(vec4 p1, vec4 p2, float x, float y);
+/// Set up the plane equations of the attributes of a triangle relative to the center of pixel (x0, y0)
+void tri_plane_setup(tri_setup &s, face &f, int x0, int y0);
 
-/// Interpolate norm values and Z values
-pt_info interp_pt(vec4 n1, vec4 n2, vec4 p1, vec4 p2, float x, float y);
+/// Average the samples of every pixel inside clip that has samples into its color (the others are left alone)
+void resolve_samples(z_buffer &zb, rect clip);
 
-/// Interpolate norm values and Z values using barycentric coordinates
-pt_info interp_barypt(face f, float x, float y);
+/// Copy the colors of the pixels inside clip from the tiled framebuffer to the row-major RGB image
+void pack_img(img_t *img, const z_buffer &zb, rect clip);
+void pack_img(img32_t &img, const z_buffer &zb, rect clip);
 
-/// Interpolate point norm values and Z values using perspective corrected depth (correct way)
-pt_info interp_pt_z(vec4 n1, vec4 n2, vec4 p1, vec4 p2, float x, float y);
-
-/// Interpolate point norm values and Z values using perspective corrected depth and barycentric coordinates(correct way)
-pt_info interp_barypt_z(face f, float x, float y);
+/// Value of a plane equation dx pixels to the right and dy pixels below its reference pixel
+float plane_at(float a, float dadx, float dady, int dx, int dy);
+vec4 plane_at(const vec4 &a, const vec4 &dadx, const vec4 &dady, int dx, int dy);
 
 /// Get triangle area
 float t_area(vec4 p1, vec4 p2, vec4 p3);
 
+/// Twice the signed area of a triangle computed exactly on the snapped coordinates (same sign as t_area).
+/// It is positive for the triangles facing the camera.
+long long t_area_fx(fx_pt s1, fx_pt s2, fx_pt s3);
+
 /// Get color from normal value
-vector <unsigned int> get_color(vector <unsigned int> &color, vec4 normal);
+void get_color(unsigned int *color, const vec4 &normal);
 
 #endif // RASTER_TOOLS_H
@@ -1,19 +1,34 @@
 TEMPLATE = app
-CONFIG += console c++11
+CONFIG += console c++11 thread
 CONFIG -= app_bundle
 CONFIG -= qt
 
+# SIMD backend of vec4/mat4: SSE2 by default. Uncomment for the AVX code (only runs on CPUs with AVX),
+# or add DEFINES += VEC4_SCALAR for the plain element-wise code.
+#QMAKE_CXXFLAGS += -mavx
+
 SOURCES += main.cpp \
     mat4.cpp \
     vec4.cpp \
     tiny_obj_loader.cc \
-    raster_tools.cpp
+    raster_tools.cpp \
+    thread_pool.cpp \
+    tile_raster.cpp \
+    vertex_stage.cpp \
+    render_context.cpp \
+    mesh_cache.cpp
 
 HEADERS += \
     mat4.h \
     vec4.h \
     tiny_obj_loader.h \
-    raster_tools.h
+    raster_tools.h \
+    span_raster.h \
+    thread_pool.h \
+    tile_raster.h \
+    vertex_stage.h \
+    render_context.h \
+    mesh_cache.h
 
 DISTFILES += \
     cube.obj \
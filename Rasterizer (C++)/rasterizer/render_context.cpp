@@ -0,0 +1,373 @@
+#include "render_context.h"
+#include "vertex_stage.h"
+#include "span_raster.h"
+#include <iostream>
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+
+// Number of pixels of the image covered by a triangle (in at least one sample when multisampling)
+static size_t count_visible(const z_buffer &zb){
+    size_t n = 0;
+    if((zb.samples > 1) && zb.slot.empty()){
+        for(size_t i = 0; i < (size_t)zb.w * zb.h; i++){
+            const float *sz = &zb.sample_z[i * zb.samples];
+            if(*min_element(sz, sz + zb.samples) < 1) n++;
+        }
+        return n;
+    }
+    for(int y = 0; y < zb.h; y++){
+        for(int x = 0; x < zb.w; x++){
+            if(zb.fb[fb_index(zb, x, y)].z < 1) n++;
+        }
+    }
+    return n;
+}
+
+// Draws the batches read from the OBJ file when streaming
+struct batch_drawer : tinyobj::ShapeBatchCallback{
+    RenderContext &ctx;
+    cam_dat &cam;
+    shade_fn shade, depth;
+
+    batch_drawer(RenderContext &ctx, cam_dat &cam, shade_fn shade, shade_fn depth) : ctx(ctx), cam(cam), shade(shade), depth(depth){
+    }
+
+    void operator()(const tinyobj::shape_t &shape, int shape_id){
+
+        // The file is still read to the end after a cancel, but nothing more is drawn
+        if(ctx.stop) return;
+        ctx.draw_batch(view_mesh(shape.mesh), shape_id, cam, shade, depth);
+    }
+};
+
+///----------------------------------------------------------------------
+/// Constructors
+///----------------------------------------------------------------------
+
+/// Create an empty context that renders with n_threads threads
+RenderContext::RenderContext(int n_threads, bool use_cache, size_t max_memory) :
+    use_cache(use_cache), max_memory(max_memory), batch_mesh(1), img(NULL), pool(n_threads), cull(CULL_NONE), sort(false), prepass(false),
+    deferred(false), vis_valid(false), msaa(1), adaptive(false), adaptive_threshold(ADAPTIVE_THRESHOLD), stop(false){
+    clear_stats(stats);
+    bins.stop = &stop;
+}
+
+/// Free the framebuffer and stop the threads
+RenderContext::~RenderContext(){
+    if(img != NULL){
+        destroy_img(&img);
+    }
+}
+
+///----------------------------------------------------------------------
+/// Methods
+///----------------------------------------------------------------------
+
+/// Load an OBJ file, from its mesh cache if there is an up to date one. Does nothing if the file is already loaded.
+bool RenderContext::load(const char *file){
+
+    if((!obj_file.empty()) && (obj_file == file)){
+        return true;
+    }
+
+    // Drop the previous mesh
+    obj_file = "";
+    vis_valid = false;
+    meshes.clear();
+    cache.close();
+    shapes.clear();
+    materials.clear();
+
+    // Map the binary cache if it matches the OBJ file. No parsing and no copies needed.
+    if(use_cache && cache.open(file, meshes, materials) && !meshes.empty()){
+        obj_file = file;
+        return true;
+    }
+
+    // When streaming, the OBJ file is read batch by batch while rendering
+    if(max_memory > 0){
+        FILE *f = fopen(file, "rb");
+        if(f == NULL){
+            cerr << "Cannot open file [" << file << "]" << endl;
+            return false;
+        }
+        fclose(f);
+        obj_file = file;
+        return true;
+    }
+
+    // Otherwise parse the object and see contents. The file is split into chunks parsed by all the threads.
+    string err = LoadObj(shapes, materials, file, NULL, pool.size());
+    if(!err.empty()){
+        cerr << err;
+    }
+    if(shapes.empty()){
+        return false;
+    }
+
+    for(unsigned int i = 0; i < shapes.size(); i++){
+        meshes.push_back(view_mesh(shapes[i].mesh));
+    }
+
+    // Save the cache for the next time (if the directory is not writable we just parse again next time)
+    if(use_cache){
+        write_mesh_cache(file, shapes, materials);
+    }
+
+    obj_file = file;
+    return true;
+}
+
+/// Render the loaded mesh with the camera into a w x h image using a shading option
+img_t *RenderContext::render(cam_dat &cam, int w, int h, char *opt){
+    if(!draw(cam, w, h, opt)) return NULL;
+    return tile_pack_img(img, z, pool);
+}
+
+/// Render the loaded mesh with the camera straight into a 32-bit image of the caller using a shading option
+void RenderContext::render(cam_dat &cam, img32_t &target, char *opt){
+    if(!draw(cam, target.w, target.h, opt)) return;
+    tile_pack_img(target, z, pool);
+}
+
+/// Draw the loaded mesh with the camera into the w x h framebuffer using a shading option
+bool RenderContext::draw(cam_dat &cam, int w, int h, char *opt){
+
+    // Cancelled before it started: draw nothing (the framebuffer may not even have the right size)
+    if(stop) return false;
+
+    // Only the shading changed: shade the visibility buffer of the last render again
+    bool use_vis = deferred && (max_memory == 0) && (msaa == 1);
+    if(use_vis && vis_valid && (z.w == w) && (z.h == h) &&
+       (cam.per_mat == vis_cam.per_mat) && (cam.rot_mat == vis_cam.rot_mat)){
+        resolve(opt);
+        return true;
+    }
+    vis_valid = false;
+
+    // The image is only reallocated when the size changes (the tile rasterizer takes its size from it)
+    if((img == NULL) || (img->w != w) || (img->h != h)){
+        if(img != NULL) destroy_img(&img);
+        img = new_img(w, h);
+    }
+
+    // Reset the framebuffer and its coarse level (and the visibility buffer or the samples). Initialize all depths to 2.
+    clear_z(z, w, h, use_vis, msaa);
+    clear_stats(stats);
+
+    // The shaders of the single pass, or of the two passes of a depth prepass.
+    // The visibility pass is the same for every option (the depth of the barycentric options) so that it can be shaded with any.
+    shade_fn shade = get_shader(opt, prepass ? PASS_SHADE : PASS_COLOR);
+    shade_fn depth = prepass ? get_shader(opt, PASS_DEPTH) : NULL;
+    if(use_vis){
+        shade = get_shader(NULL, PASS_VIS);
+        depth = NULL;
+    }
+    if(msaa > 1){
+        shade = get_shader(opt, PASS_MSAA);
+        depth = NULL;
+    }
+
+    // Unknown shading option, nothing to draw (the framebuffer is left black)
+    if(shade == NULL) return true;
+
+    // Stream the triangles in batches that fit in the memory budget
+    if(max_memory > 0){
+        size_t n = batch_size(w, h);
+
+        // Slice the meshes of the mapped cache
+        for(unsigned int s = 0; s < meshes.size(); s++){
+            size_t n_tris = meshes[s].n_indices / 3;
+            for(size_t t = 0; (t < n_tris) && !stop; t += n){
+                slice_mesh(meshes[s], t, min(n, n_tris - t), batch, batch_verts);
+                draw_batch(view_mesh(batch), s, cam, shade, depth);
+            }
+        }
+
+        // Or read the OBJ file
+        if(meshes.empty()){
+            materials.clear();
+            batch_drawer drawer(*this, cam, shade, depth);
+            string err = LoadObjBatches(materials, obj_file.c_str(), NULL, n, drawer);
+            if(!err.empty()){
+                cerr << err;
+            }
+        }
+        if(msaa > 1) tile_resolve_samples(z, pool);
+        stats.pixels_visible = count_visible(z);
+        return true;
+    }
+
+    // Transform the vertices of every shape to pixel coordinates, depth and 1/w and rotate the normals to the camera frame
+    transform_shapes(verts, meshes, cam, w, h, pool);
+
+    // Gather the triangles of each shape and their bounding boxes
+    pix_triangles.resize(meshes.size());
+    bboxes.resize(meshes.size());
+    for(unsigned int i = 0; i < meshes.size(); i++){
+        world_to_im(meshes[i], verts[i], pix_triangles[i], cam, w, h, cull, stats, msaa);
+    }
+    sort_triangles();
+    for(unsigned int i = 0; i < meshes.size(); i++){
+        get_bbox(pix_triangles[i], w, h, bboxes[i]);
+    }
+
+    // Fill the image using face data and other data depending on the option chosen.
+    // The image is split into tiles which are filled in parallel. Each triangle is walked using its edge functions.
+    // The shading option is resolved once here to a specialized span rasterizer.
+    tile_fill_img(img, pix_triangles, bboxes, materials, z, shade, bins, pool, stats, 0, depth);
+    if(msaa > 1) tile_resolve_samples(z, pool);
+    stats.pixels_visible = count_visible(z);
+
+    // Adaptive supersampling: draw the pixels that stand out from their neighbours again with several shaded samples each
+    if(adaptive && (msaa == 1) && !use_vis && !stop){
+        stats.pixels_refined = refine_pixels(z, adaptive_threshold, ADAPTIVE_SAMPLES);
+        tile_fill_img(img, pix_triangles, bboxes, materials, z, get_shader(opt, PASS_SUPER), bins, pool, stats);
+        tile_resolve_samples(z, pool);
+    }
+
+    // Deferred shading: the visible pixels are shaded now, and again by the next renders from the same view
+    if(use_vis){
+        // A cancelled render leaves some tiles out, so its visibility buffer is not shaded again
+        vis_valid = !stop;
+        vis_cam = cam;
+        resolve(opt);
+    }
+    return true;
+}
+
+/// Shade the framebuffer from the visibility buffer with a shading option
+void RenderContext::resolve(char *opt){
+
+    // Unknown shading option, nothing to draw
+    resolve_fn r = get_resolver(opt);
+    if(r == NULL){
+        for(size_t i = 0; i < z.fb_mem.size(); i++){
+            z.fb_mem[i].r = z.fb_mem[i].g = z.fb_mem[i].b = 0;
+        }
+        return;
+    }
+
+    tile_resolve_img(img, pix_triangles, materials, z, r, pool);
+    stats.pixels_shaded = stats.pixels_visible;
+}
+
+/// Sort the triangles of every shape front to back and order the shapes by their nearest triangle
+void RenderContext::sort_triangles(){
+
+    bins.order.clear();
+    if(!sort) return;
+
+    for(unsigned int i = 0; i < pix_triangles.size(); i++){
+        sort_front_to_back(pix_triangles[i], sort_scratch, sort_first);
+    }
+
+    // After sorting the first triangle of a shape is its nearest one. Shapes with no triangles go last. Ties keep the
+    // shape order, which gives the order of a stable sort without the buffer stable_sort allocates.
+    bins.order.resize(pix_triangles.size());
+    for(unsigned int i = 0; i < bins.order.size(); i++){
+        bins.order[i] = i;
+    }
+    vector< vector<face> > &tris = pix_triangles;
+    std::sort(bins.order.begin(), bins.order.end(), [&tris](unsigned int a, unsigned int b){
+        if(tris[a].empty() != tris[b].empty()) return tris[b].empty();
+        if(!tris[a].empty()){
+            float za = near_z(tris[a][0]), zb = near_z(tris[b][0]);
+            if(za != zb) return za < zb;
+        }
+        return a < b;
+    });
+}
+
+/// Number of triangles per batch that fits in the memory budget next to a w x h framebuffer
+size_t RenderContext::batch_size(int w, int h){
+    size_t frame = (size_t)w * h * (sizeof(pixel_t) + sizeof(fb_pixel));
+    if(msaa > 1) frame += (size_t)w * h * msaa * (sizeof(pixel_t) + sizeof(float));
+    // The framebuffer cannot be streamed, so a budget below it is exceeded anyway: say so rather than ignore it
+    if(max_memory < frame + STREAM_MIN_BATCH * STREAM_TRI_BYTES){
+        cerr << "Warning: a " << w << "x" << h << " image needs at least "
+             << (frame + STREAM_MIN_BATCH * STREAM_TRI_BYTES + (1 << 20) - 1) / (1 << 20)
+             << " MB, more than the memory budget. Streaming with the smallest batches." << endl;
+        return STREAM_MIN_BATCH;
+    }
+    return max((size_t)STREAM_MIN_BATCH, (max_memory - frame) / STREAM_TRI_BYTES);
+}
+
+/// Transform, cull and rasterize a batch of triangles of shape s
+void RenderContext::draw_batch(const mesh_view &mesh, unsigned int s, cam_dat &cam, shade_fn shade, shade_fn depth){
+
+    int w = img->w, h = img->h;
+
+    // The batch goes through the same stages as a whole shape, reusing the buffers of the previous batch
+    batch_mesh[0] = mesh;
+    transform_shapes(verts, batch_mesh, cam, w, h, pool);
+    pix_triangles.resize(1);
+    bboxes.resize(1);
+    world_to_im(batch_mesh[0], verts[0], pix_triangles[0], cam, w, h, cull, stats, msaa);
+    sort_triangles();
+    get_bbox(pix_triangles[0], w, h, bboxes[0]);
+
+    // The Z-buffer keeps the depth of the batches drawn before
+    tile_fill_img(img, pix_triangles, bboxes, materials, z, shade, bins, pool, stats, s, depth);
+}
+
+/// The image of the last render
+img_t *RenderContext::image(){
+    return img;
+}
+
+/// Set which triangles are culled by the way they face the camera
+void RenderContext::set_cull(cull_mode mode){
+    if(mode != cull) vis_valid = false;
+    cull = mode;
+}
+
+/// Sort the triangles front to back before drawing them
+void RenderContext::set_sort(bool front_to_back){
+    if(front_to_back != sort) vis_valid = false;
+    sort = front_to_back;
+}
+
+/// Draw a depth only pass before the shading pass
+void RenderContext::set_prepass(bool depth_prepass){
+    prepass = depth_prepass;
+}
+
+/// Rasterize only the visible triangle of every pixel and shade each pixel once afterwards
+void RenderContext::set_deferred(bool deferred_shading){
+    deferred = deferred_shading;
+}
+
+/// Multisample with 2, 4 or 8 samples per pixel (1 turns it off)
+bool RenderContext::set_msaa(int samples){
+    if((samples != 1) && (msaa_pattern(samples) == NULL)) return false;
+    msaa = samples;
+    return true;
+}
+
+/// Draw the pixels on the edges again with several samples each
+void RenderContext::set_adaptive(bool on, float threshold){
+    adaptive = on;
+    adaptive_threshold = threshold;
+}
+
+/// Stop the render in progress as soon as possible
+void RenderContext::cancel(){
+    stop = true;
+}
+
+/// Let the next renders run again after a cancel
+void RenderContext::clear_cancel(){
+    stop = false;
+}
+
+/// Whether renders are cancelled (since the last clear_cancel)
+bool RenderContext::cancelled() const{
+    return stop;
+}
+
+/// Counters of the last render
+const render_stats &RenderContext::last_stats() const{
+    return stats;
+}
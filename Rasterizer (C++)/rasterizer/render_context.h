@@ -0,0 +1,195 @@
+// The RenderContext keeps everything needed to draw a mesh alive between frames: the parsed mesh,
+// the transformed vertices, the triangles and their tiles, the framebuffer, the Z-buffer and the threads.
+// Rendering again with a new camera only redoes the projection and the rasterization, reusing all the buffers.
+//
+// With deferred shading the rasterizer only keeps the visible triangle of every pixel, which is then shaded once.
+// Rendering again with the same camera and size then just shades that visibility buffer with the new option.
+//
+// With a memory budget the context streams instead: the triangles are drawn in batches small enough to fit
+// in the budget, each batch being transformed, culled and rasterized before the next one is read. The batches
+// come from the mapped mesh cache, or straight from the OBJ file (which is then read again at every render).
+
+#ifndef RENDER_CONTEXT_H
+#define RENDER_CONTEXT_H
+
+#include <string>
+#include <atomic>
+#include "raster_tools.h"
+#include "thread_pool.h"
+#include "tile_raster.h"
+#include "mesh_cache.h"
+
+/// Memory used per triangle of a batch when streaming (triangle and vertex copies, transformed vertices, face, bounding box and tile lists)
+#define STREAM_TRI_BYTES 512
+
+/// Smallest number of triangles in a batch when streaming
+#define STREAM_MIN_BATCH 1024
+
+class RenderContext {
+private:
+    ///The mesh and the file it came from. The views point either into the parsed shapes or into the mapped cache file.
+    std::string obj_file;
+    vector<tinyobj::shape_t> shapes;
+    vector<tinyobj::material_t> materials;
+    vector<mesh_view> meshes;
+    mesh_cache cache;
+    bool use_cache;
+
+    ///Memory budget in bytes when streaming (0 to keep the whole mesh in memory)
+    size_t max_memory;
+
+    ///Triangles of the current batch when streaming
+    tinyobj::mesh_t batch;
+    vector<unsigned int> batch_verts; // Vertices of the mesh used by the batch
+    vector<mesh_view> batch_mesh;     // View of the batch
+
+    ///Buffers rebuilt every frame (their memory is kept between frames)
+    vector<vert_soa> verts;                 // Transformed vertices of each shape
+    vector< vector<face> > pix_triangles;   // Triangles of each shape in pixel coordinates
+    vector< vector<bbox> > bboxes;          // Bounding boxes of the triangles
+    tile_bins bins;                         // Triangles overlapping each screen tile
+
+    ///Image and the tiled framebuffer (depth and color) it is packed from
+    img_t *img;
+    z_buffer z;
+
+    ///Threads used by the vertex stage and the rasterizer
+    thread_pool pool;
+
+    ///Culling options and the counters of the last render
+    cull_mode cull;
+    render_stats stats;
+
+    ///Whether the triangles are sorted front to back before drawing, and the scratch space of the sort
+    bool sort;
+    vector<face> sort_scratch;
+    vector<size_t> sort_first;
+
+    ///Whether a depth only pass is drawn before the shading pass
+    bool prepass;
+
+    ///Deferred shading, and whether the visibility buffer (in z) holds the triangles of pix_triangles seen from vis_cam
+    bool deferred;
+    bool vis_valid;
+    cam_dat vis_cam;
+
+    ///Samples per pixel when multisampling (1 when off)
+    int msaa;
+
+    ///Adaptive supersampling and the contrast above which it refines a pixel
+    bool adaptive;
+    float adaptive_threshold;
+
+    /// Set by cancel to stop the render in progress and the ones after it (until clear_cancel)
+    std::atomic<bool> stop;
+
+    /// Not copyable (owns the framebuffer and the threads)
+    RenderContext(const RenderContext &);
+    RenderContext &operator=(const RenderContext &);
+
+    /// Sort the triangles of every shape front to back and order the shapes by their nearest triangle (when sorting)
+    void sort_triangles();
+
+    /// Draw a frame into the w x h framebuffer (everything but copying the colors out, see render).
+    /// Returns false when cancelled before it started, in which case the framebuffer is left as it was.
+    bool draw(cam_dat &cam, int w, int h, char *opt);
+
+    /// Shade the framebuffer from the visibility buffer with a shading option
+    void resolve(char *opt);
+
+    /// Number of triangles per batch that fits in the memory budget next to a w x h framebuffer. The framebuffer and
+    /// STREAM_MIN_BATCH triangles are the least a render needs: below that a warning is printed and the budget is exceeded.
+    size_t batch_size(int w, int h);
+
+    /// Transform, cull and rasterize a batch of triangles of shape s
+    void draw_batch(const mesh_view &mesh, unsigned int s, cam_dat &cam, shade_fn shade, shade_fn depth);
+
+    /// Draws the batches read from the OBJ file
+    friend struct batch_drawer;
+
+public:
+    ///----------------------------------------------------------------------
+    /// Constructors
+    ///----------------------------------------------------------------------
+
+    /// Create an empty context that renders with n_threads threads.
+    /// With use_cache the meshes are loaded from (and saved to) binary mesh cache files next to the OBJ files.
+    /// With a max_memory budget (in bytes) the meshes are streamed in batches and the cache is only read, never written.
+    /// The budget must at least hold the framebuffer (see batch_size), otherwise it is exceeded with a warning.
+    RenderContext(int n_threads, bool use_cache = true, size_t max_memory = 0);
+
+    /// Free the framebuffer and stop the threads
+    ~RenderContext();
+
+    ///----------------------------------------------------------------------
+    /// Methods
+    ///----------------------------------------------------------------------
+
+    /// Load an OBJ file, from its mesh cache if there is an up to date one. Does nothing if the file is already loaded.
+    /// When streaming without a cache the file is only checked here and read while rendering.
+    /// Returns false (and prints the error) if it could not be read.
+    bool load(const char *file);
+
+    /// Render the loaded mesh with the camera into a w x h image using a shading option (see get_shader).
+    /// The image belongs to the context and is overwritten by the next call. Returns NULL when the render was cancelled
+    /// before it started.
+    img_t *render(cam_dat &cam, int w, int h, char *opt);
+
+    /// Render as above straight into a 32-bit image owned by the caller, at its size. The colors are written once, from
+    /// the tiled framebuffer to the target, so a viewer can hand its own QImage::Format_RGB32 pixels (with their stride)
+    /// and display them without any copy or conversion. Nothing is allocated unless the size changes.
+    /// The target is left untouched when the render was cancelled before it started.
+    void render(cam_dat &cam, img32_t &target, char *opt);
+
+    /// The image of the last render into an img_t (NULL before the first one)
+    img_t *image();
+
+    /// Set which triangles are culled by the way they face the camera (CULL_NONE by default)
+    void set_cull(cull_mode mode);
+
+    /// Sort the triangles front to back before drawing them (off by default). The nearest triangles then fill the
+    /// Z-buffer first, so fewer pixels are shaded and then covered again and more of the far ones are rejected early.
+    /// Only the order of triangles at exactly the same depth can change the image.
+    void set_sort(bool front_to_back);
+
+    /// Draw the depth of all the triangles first and then color only the visible pixels, each exactly once (off by default).
+    /// Pays off for the perspective corrected normal modes when many pixels are covered more than once.
+    /// When streaming, each batch gets its own two passes.
+    void set_prepass(bool depth_prepass);
+
+    /// Rasterize only the visible triangle of every pixel and shade each pixel once afterwards (off by default).
+    /// Rendering again with the same camera and size (say to switch from --norm_gouraud to --norm_bary_z) then only
+    /// shades again without rasterizing. Gouraud options shade like the barycentric ones in this mode.
+    /// Not available when streaming, where the triangles of a batch are gone once it is drawn.
+    void set_deferred(bool deferred_shading);
+
+    /// Multisample with 2, 4 or 8 samples per pixel (1 turns it off, the default). Returns false for any other count,
+    /// which leaves the setting unchanged.
+    /// Coverage and depth are tested at every sample but each pixel is shaded once per triangle, and the samples are
+    /// averaged into the image at the end, which smooths the edges. The Z-buffer holds a depth and a color per sample.
+    /// Depth prepass and deferred shading are not used while multisampling. Gouraud options shade like the barycentric ones.
+    bool set_msaa(int samples);
+
+    /// Draw the pixels on the edges again with ADAPTIVE_SAMPLES samples each (off by default). The image is rendered once,
+    /// then the pixels at silhouettes or differing from a neighbour by more than threshold in color or relative depth
+    /// (see refine_pixels) are rasterized again with every sample shaded, and their samples averaged. A higher threshold
+    /// refines fewer pixels. The fraction refined is in the counters. Not used with multisampling, deferred shading or streaming.
+    void set_adaptive(bool on, float threshold = ADAPTIVE_THRESHOLD);
+
+    /// Stop the render in progress as soon as possible: the tiles not started yet and the remaining batches are skipped.
+    /// The renders started afterwards draw nothing until clear_cancel is called, so a cancel is never lost when it arrives
+    /// just before a render. This is the only method that may be called from another thread while rendering.
+    /// The image of a cancelled render is incomplete.
+    void cancel();
+
+    /// Let the next renders run again after a cancel
+    void clear_cancel();
+
+    /// Whether renders are cancelled (since the last clear_cancel)
+    bool cancelled() const;
+
+    /// Counters of the last render
+    const render_stats &last_stats() const;
+};
+
+#endif /* RENDER_CONTEXT_H */
@@ -0,0 +1,73 @@
+// The thread_pool class keeps a fixed set of worker threads alive between renders.
+// Work is handed out as numbered jobs; the calling thread helps out and run() returns once every job is done.
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+class thread_pool {
+private:
+    ///The worker threads (the calling thread is not part of this list)
+    std::vector<std::thread> workers;
+
+    ///Lock and signals used to start a batch of jobs and to report that it is finished
+    std::mutex lock;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+
+    ///Current batch of jobs
+    void (*job)(const void *, int);      // Function called with the context and each job number
+    const void *job_ctx;                 // Context of the batch (the callable passed to run())
+    int n_jobs;                          // Number of jobs in the batch
+    std::atomic<int> next_job;           // Next job number to hand out
+    int busy;                            // Number of workers still working on the batch
+    unsigned long batch;                 // Incremented every time a new batch starts
+    bool quit;                           // Set when the pool is destroyed
+
+    /// Loop run by every worker thread
+    void work();
+
+    /// Take job numbers and run them until the batch is empty
+    void drain();
+
+    /// Call the callable ctx of type F with job number i
+    template <class F>
+    static void call(const void *ctx, int i){
+        (*(const F *)ctx)(i);
+    }
+
+    /// Run fn(ctx, 0) ... fn(ctx, count - 1) spread over the threads and wait for all of them to finish
+    void run_jobs(int count, void (*fn)(const void *, int), const void *ctx);
+
+public:
+    ///----------------------------------------------------------------------
+    /// Constructors
+    ///----------------------------------------------------------------------
+
+    /// Start a pool that runs jobs on n_threads threads in total (including the calling thread)
+    thread_pool(int n_threads);
+
+    /// Stop and join all the workers
+    ~thread_pool();
+
+    ///----------------------------------------------------------------------
+    /// Methods
+    ///----------------------------------------------------------------------
+
+    /// Number of threads (including the calling thread) that run jobs
+    int size() const;
+
+    /// Call f(0) ... f(count - 1) spread over the threads and wait for all of them to finish.
+    /// f is passed on as a plain pointer, so starting a batch never allocates.
+    template <class F>
+    void run(int count, const F &f){
+        run_jobs(count, &call<F>, &f);
+    }
+};
+
+#endif /* THREAD_POOL_H */
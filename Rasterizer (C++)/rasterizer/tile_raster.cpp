@@ -0,0 +1,157 @@
+#include "tile_raster.h"
+#include <math.h>
+
+// Pixels of tile t of a w x h image split into tiles_x tiles across
+static rect tile_rect(int t, int tiles_x, int w, int h){
+    rect clip;
+    clip.x0 = (t % tiles_x) * TILE_SIZE;
+    clip.y0 = (t / tiles_x) * TILE_SIZE;
+    clip.x1 = min(clip.x0 + TILE_SIZE, w);
+    clip.y1 = min(clip.y0 + TILE_SIZE, h);
+    return clip;
+}
+
+// Sort the triangles of every shape into the screen tiles covered by their bounding boxes
+void bin_triangles(tile_bins &bins, vector< vector<bbox> > &bboxes, int w, int h){
+
+    bins.tiles_x = (w + TILE_SIZE - 1) / TILE_SIZE;
+    bins.tiles_y = (h + TILE_SIZE - 1) / TILE_SIZE;
+
+    // Every tile gets an (initially empty) list of triangles for each shape.
+    // The lists are cleared rather than rebuilt so they keep their memory.
+    bins.ids.resize(bins.tiles_x * bins.tiles_y);
+    for(unsigned int t = 0; t < bins.ids.size(); t++){
+        bins.ids[t].resize(bboxes.size());
+        for(unsigned int s = 0; s < bboxes.size(); s++){
+            bins.ids[t][s].clear();
+        }
+    }
+
+    int x_start, x_stop, y_start, y_stop;
+
+    for(unsigned int s = 0; s < bboxes.size(); s++){
+        for(unsigned int i = 0; i < bboxes[s].size(); i++){
+
+            bbox b = bboxes[s][i];
+
+            // Pixel range covered by the bounding box of the triangle
+            x_start = max(0, (int)floor(b.x));
+            x_stop = min(w - 1, (int)ceil(b.x + b.w));
+            y_start = max(0, (int)floor(b.y));
+            y_stop = min(h - 1, (int)ceil(b.y + b.h));
+
+            // Add the triangle to every tile in the range. Triangles are visited in draw order so the lists stay sorted.
+            for(int ty = y_start / TILE_SIZE; ty <= y_stop / TILE_SIZE; ty++){
+                for(int tx = x_start / TILE_SIZE; tx <= x_stop / TILE_SIZE; tx++){
+                    bins.ids[ty * bins.tiles_x + tx][s].push_back(i);
+                }
+            }
+        }
+    }
+}
+
+// Fill the image one tile at a time on the threads of the pool
+img_t *tile_fill_img(img_t *img, vector< vector<face> > &pix_triangles, vector< vector<bbox> > &bboxes,
+                     vector<tinyobj::material_t> &materials, z_buffer &zb, shade_fn shade, tile_bins &bins, thread_pool &pool,
+                     render_stats &stats, unsigned int first_shape, shade_fn depth){
+
+    // Unknown shading option, nothing to draw
+    if(shade == NULL) return img;
+
+    // Sort the triangles into tiles using their bounding boxes
+    bin_triangles(bins, bboxes, img->w, img->h);
+
+    // Each tile counts into its own stats so that the threads never share a counter
+    bins.stats.resize(bins.ids.size());
+    for(unsigned int t = 0; t < bins.stats.size(); t++){
+        clear_stats(bins.stats[t]);
+    }
+
+    // Each job draws all the shapes (in the order of bins.order) into one tile.
+    // Since the tiles do not overlap, no two threads ever write the same pixel or Z-buffer entry.
+    pool.run(bins.tiles_x * bins.tiles_y, [&](int t){
+
+        // The render was cancelled
+        if((bins.stop != NULL) && bins.stop->load(memory_order_relaxed)) return;
+
+        rect clip = tile_rect(t, bins.tiles_x, img->w, img->h);
+
+        // Depth prepass: find the nearest depth of every pixel of the tile before coloring any
+        if(depth != NULL){
+            for(unsigned int k = 0; k < pix_triangles.size(); k++){
+                unsigned int s = bins.order.empty() ? k : bins.order[k];
+                if(bins.ids[t][s].empty()) continue;
+                depth(img, pix_triangles[s], s, materials[first_shape + s], zb, bins.ids[t][s], clip, bins.stats[t]);
+            }
+        }
+
+        for(unsigned int k = 0; k < pix_triangles.size(); k++){
+            unsigned int s = bins.order.empty() ? k : bins.order[k];
+            if(bins.ids[t][s].empty()) continue;
+            shade(img, pix_triangles[s], s, materials[first_shape + s], zb, bins.ids[t][s], clip, bins.stats[t]);
+        }
+    });
+
+    for(unsigned int t = 0; t < bins.stats.size(); t++){
+        stats.hiz_triangles += bins.stats[t].hiz_triangles;
+        stats.hiz_culled_triangles += bins.stats[t].hiz_culled_triangles;
+        stats.hiz_spans += bins.stats[t].hiz_spans;
+        stats.hiz_culled_spans += bins.stats[t].hiz_culled_spans;
+        stats.pixels_tested += bins.stats[t].pixels_tested;
+        stats.pixels_shaded += bins.stats[t].pixels_shaded;
+        stats.samples_shaded += bins.stats[t].samples_shaded;
+    }
+
+    return img;
+}
+
+// Shade the whole framebuffer from the visibility buffer one tile at a time on the threads of the pool
+img_t *tile_resolve_img(img_t *img, vector< vector<face> > &pix_triangles, vector<tinyobj::material_t> &materials,
+                        z_buffer &zb, resolve_fn resolve, thread_pool &pool){
+
+    int tiles_x = (img->w + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (img->h + TILE_SIZE - 1) / TILE_SIZE;
+
+    // Every pixel only reads its own entries of the visibility buffer, so the tiles are independent
+    pool.run(tiles_x * tiles_y, [&](int t){
+        rect clip = tile_rect(t, tiles_x, img->w, img->h);
+        resolve(img, pix_triangles, materials, zb, clip);
+    });
+
+    return img;
+}
+
+// Copy the colors of the tiled framebuffer to the image one tile at a time on the threads of the pool
+img_t *tile_pack_img(img_t *img, z_buffer &zb, thread_pool &pool){
+
+    int tiles_x = (img->w + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (img->h + TILE_SIZE - 1) / TILE_SIZE;
+
+    pool.run(tiles_x * tiles_y, [&](int t){
+        pack_img(img, zb, tile_rect(t, tiles_x, img->w, img->h));
+    });
+
+    return img;
+}
+
+// Copy the colors of the tiled framebuffer to a 32-bit image one tile at a time on the threads of the pool
+void tile_pack_img(img32_t &img, z_buffer &zb, thread_pool &pool){
+
+    int tiles_x = (img.w + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (img.h + TILE_SIZE - 1) / TILE_SIZE;
+
+    pool.run(tiles_x * tiles_y, [&](int t){
+        pack_img(img, zb, tile_rect(t, tiles_x, img.w, img.h));
+    });
+}
+
+// Average the samples into the colors of the framebuffer one tile at a time on the threads of the pool
+void tile_resolve_samples(z_buffer &zb, thread_pool &pool){
+
+    int tiles_x = (zb.w + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (zb.h + TILE_SIZE - 1) / TILE_SIZE;
+
+    pool.run(tiles_x * tiles_y, [&](int t){
+        resolve_samples(zb, tile_rect(t, tiles_x, zb.w, zb.h));
+    });
+}
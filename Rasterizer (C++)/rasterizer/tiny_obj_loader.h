@@ -85,6 +85,39 @@ std::string LoadObj(std::vector<shape_t> &shapes,       // [output]
                     std::vector<material_t> &materials, // [output]
                     std::istream &inStream, MaterialReader &readMatFn);
 
+/// Loads .obj from a file using 'num_threads' threads.
+/// The file is mapped into memory and cut into chunks at line boundaries
+/// which are parsed in parallel. The result is the same as with the
+/// single threaded loader, whatever the number of threads.
+/// Returns empty string when loading .obj success.
+std::string LoadObj(std::vector<shape_t> &shapes,       // [output]
+                    std::vector<material_t> &materials, // [output]
+                    const char *filename, const char *mtl_basepath,
+                    int num_threads);
+
+/// Receives the triangles of an .obj file in batches (see LoadObjBatches).
+class ShapeBatchCallback {
+public:
+  ShapeBatchCallback() {}
+  virtual ~ShapeBatchCallback() {}
+
+  /// Called with the next batch of triangles of the shape 'shape_id'.
+  /// The batch is only valid during the call.
+  virtual void operator()(const shape_t &batch, int shape_id) = 0;
+};
+
+/// Reads .obj from a file and hands its triangles over in batches of about
+/// 'max_triangles' triangles (a face is never split) instead of keeping them.
+/// Only the vertex data of the file stays in memory. Vertices are
+/// deduplicated within a batch only.
+/// Shapes are numbered in the order LoadObj would return them, except that
+/// LoadObj drops a shape whose last face group is empty.
+/// Returns empty string when loading .obj success.
+std::string LoadObjBatches(std::vector<material_t> &materials, // [output]
+                           const char *filename, const char *mtl_basepath,
+                           size_t max_triangles,
+                           ShapeBatchCallback &callback);
+
 /// Loads materials into std::map
 /// Returns an empty string if successful
 std::string LoadMtl(std::map<std::string, int> &material_map,
@@ -6,9 +6,13 @@
 /// Constructors
 ///----------------------------------------------------------------------
 vec4::vec4(void){
+#ifdef VEC4_SCALAR
     for(int i=0 ; i<4 ; i++){
         data[i] = 0;
     }
+#else
+    _mm_store_ps(data, _mm_setzero_ps());
+#endif
 }
 
 vec4::vec4(float x, float y, float z, float w){
@@ -19,9 +23,13 @@ vec4::vec4(float x, float y, float z, float w){
 }
 
 vec4::vec4(const vec4 &v2){
+#ifdef VEC4_SCALAR
     for(int i=0 ; i<4 ; i++){
         data[i] = v2.data[i];
     }
+#else
+    _mm_store_ps(data, _mm_load_ps(v2.data));
+#endif
 }
 
 ///----------------------------------------------------------------------
@@ -59,14 +67,19 @@ float &vec4::operator()(unsigned int index){
 
 ///// Assign v2 to this and return a reference to this
 vec4 &vec4::operator=(const vec4 &v2){
+#ifdef VEC4_SCALAR
     for(int i=0 ; i<4 ; i++){
         data[i] = v2[i];
     }
+#else
+    _mm_store_ps(data, _mm_load_ps(v2.data));
+#endif
     return *this;
 }
 
 /// Test for equality
 bool vec4::operator==(const vec4 &v2) const{   //Component-wise comparison
+#ifdef VEC4_SCALAR
     for(int i=0 ; i<4 ; i++){
         //If there is even one data mismatch, return false
         if(v2[i] != data[i]){
@@ -74,6 +87,10 @@ bool vec4::operator==(const vec4 &v2) const{   //Component-wise comparison
         }
     }
     return true;
+#else
+    // All 4 lanes have to compare equal
+    return _mm_movemask_ps(_mm_cmpeq_ps(_mm_load_ps(data), _mm_load_ps(v2.data))) == 0xF;
+#endif
 }
 
 /// Test for inequality
@@ -86,63 +103,95 @@ bool vec4::operator!=(const vec4 &v2) const{ //Component-wise comparison
 /// e.g. += adds v2 to this and return this (like regular +=)
 ///      +  returns a new vector that is sum of this and v2
 vec4 &vec4::operator+=(const vec4 &v2){
+#ifdef VEC4_SCALAR
     for(int i=0 ; i<4 ; i++){
         data[i] += v2[i];
     }
+#else
+    _mm_store_ps(data, _mm_add_ps(_mm_load_ps(data), _mm_load_ps(v2.data)));
+#endif
     return *this;
 }
 
 vec4 &vec4::operator-=(const vec4 &v2){
+#ifdef VEC4_SCALAR
     for(int i=0 ; i<4 ; i++){
         data[i] -= v2[i];
     }
+#else
+    _mm_store_ps(data, _mm_sub_ps(_mm_load_ps(data), _mm_load_ps(v2.data)));
+#endif
     return *this;
 }
 
 vec4 &vec4::operator*=(float c){// multiplication by a scalar
+#ifdef VEC4_SCALAR
     for(int i=0 ; i<4 ; i++){
         data[i] *= c;
     }
+#else
+    _mm_store_ps(data, _mm_mul_ps(_mm_load_ps(data), _mm_set1_ps(c)));
+#endif
     return *this;
 }
 
 vec4 &vec4::operator/=(float c){// division by a scalar
+#ifdef VEC4_SCALAR
     for(int i=0 ; i<4 ; i++){
         data[i] /= c;
     }
+#else
+    _mm_store_ps(data, _mm_div_ps(_mm_load_ps(data), _mm_set1_ps(c)));
+#endif
     return *this;
 }
 
 
 vec4 vec4::operator+(const vec4 &v2) const{ //Element wise addition
     vec4 result;
+#ifdef VEC4_SCALAR
     for(int i=0 ; i<4 ; i++){
         result[i] = data[i] + v2[i];
     }
+#else
+    _mm_store_ps(result.data, _mm_add_ps(_mm_load_ps(data), _mm_load_ps(v2.data)));
+#endif
     return result;
 }
 
 vec4 vec4::operator-(const vec4 &v2) const{ //Element wise subtraction
     vec4 result;
+#ifdef VEC4_SCALAR
     for(int i=0 ; i<4 ; i++){
         result[i] = data[i] - v2[i];
     }
+#else
+    _mm_store_ps(result.data, _mm_sub_ps(_mm_load_ps(data), _mm_load_ps(v2.data)));
+#endif
     return result;
 }
 
 vec4 vec4::operator*(float c) const{  // multiplication by a scalar
     vec4 result;
+#ifdef VEC4_SCALAR
     for(int i=0 ; i<4 ; i++){
         result[i] = data[i] * c;
     }
+#else
+    _mm_store_ps(result.data, _mm_mul_ps(_mm_load_ps(data), _mm_set1_ps(c)));
+#endif
     return result;
 }
 
 vec4 vec4::operator/(float c) const{ // division by a scalar
     vec4 result;
+#ifdef VEC4_SCALAR
     for(int i=0 ; i<4 ; i++){
         result[i] = data[i] / c;
     }
+#else
+    _mm_store_ps(result.data, _mm_div_ps(_mm_load_ps(data), _mm_set1_ps(c)));
+#endif
     return result;
 }
 
@@ -152,12 +201,17 @@ vec4 vec4::operator/(float c) const{ // division by a scalar
 
 /// Returns the geometric length of the input vector
 float vec4::length() const{
+#ifdef VEC4_SCALAR
     float n = 0.0;
     // Length is the root of sum of squares of the elements
     for(int i=0 ; i<4 ; i++){
         n += pow(data[i],2.0);
     }
     return sqrt(n);
+#else
+    // Length is the root of the dot product with itself
+    return _mm_cvtss_f32(_mm_sqrt_ss(_mm_set_ss(dot(*this, *this))));
+#endif
 }
 
 /// return a new vec4 that is a normalized (unit-length) version of this one
@@ -179,12 +233,20 @@ void vec4::norm(){
 
 /// Dot Product
 float dot(const vec4 &v1, const vec4 &v2){
+#ifdef VEC4_SCALAR
     float sum = 0.0;
     // Dot product is sum of element wise product of the 2 vectors
     for(int i=0 ; i<4 ; i++){
         sum += v1[i]*v2[i];
     }
     return sum;
+#else
+    // Element wise product followed by a horizontal sum of the 4 lanes
+    __m128 p = _mm_mul_ps(_mm_load_ps(v1.data), _mm_load_ps(v2.data));
+    __m128 s = _mm_add_ps(p, _mm_movehl_ps(p, p));                      // (p0 + p2, p1 + p3, ...)
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 1, 1, 1)));  // (p0 + p2) + (p1 + p3)
+    return _mm_cvtss_f32(s);
+#endif
 }
 
 /// Cross Product
@@ -193,19 +255,34 @@ vec4 cross(const vec4 &v1, const vec4 &v2){
     //In other words, treat v1 and v2 as 3D vectors, not 4D vectors.
     //The fourth element of the resultant vector should be 0.
     vec4 result; // Initialize zero result vector
+#ifdef VEC4_SCALAR
     //Implement cross product formula
     result[0] = v1[1]*v2[2] - v2[1]*v1[2];
     result[1] = v1[2]*v2[0] - v2[2]*v1[0];
     result[2] = v1[0]*v2[1] - v2[0]*v1[1];
+#else
+    // (y1, z1, x1) * (z2, x2, y2) - (y2, z2, x2) * (z1, x1, y1). The w lanes cancel out to 0.
+    __m128 a = _mm_load_ps(v1.data);
+    __m128 b = _mm_load_ps(v2.data);
+    __m128 a_yzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 b_yzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 a_zxy = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 0, 2));
+    __m128 b_zxy = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 1, 0, 2));
+    _mm_store_ps(result.data, _mm_sub_ps(_mm_mul_ps(a_yzx, b_zxy), _mm_mul_ps(b_yzx, a_zxy)));
+#endif
     return result;
 }
 
 /// Scalar Multiplication (c * v)
 vec4 operator*(float c, const vec4 &v){
     vec4 result;
+#ifdef VEC4_SCALAR
     for(int i=0 ; i<4 ; i++){
         result[i] = c*v[i];
     }
+#else
+    _mm_store_ps(result.data, _mm_mul_ps(_mm_set1_ps(c), _mm_load_ps(v.data)));
+#endif
     return result;
 }
 
@@ -11,7 +11,14 @@ greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 TARGET = gui
 TEMPLATE = app
 
-CONFIG += console c++11
+CONFIG += console c++11 thread
+
+# SIMD backend of vec4/mat4: SSE2 by default. Uncomment for the AVX code (only runs on CPUs with AVX),
+# or add DEFINES += VEC4_SCALAR for the plain element-wise code.
+#QMAKE_CXXFLAGS += -mavx
+
+# Rescale the interpolated normals to unit length before coloring
+DEFINES += NORMALIZE_NORMALS
 
 # The following define makes your compiler emit warnings if you use
 # any feature of Qt which as been marked as deprecated (the exact warnings
@@ -32,7 +39,13 @@ SOURCES += main.cpp \
     tiny_obj_loader.cc \
     vec4.cpp \
     rast_main.cpp \
-    img_proc.cpp
+    img_proc.cpp \
+    thread_pool.cpp \
+    tile_raster.cpp \
+    vertex_stage.cpp \
+    render_context.cpp \
+    mesh_cache.cpp \
+    render_worker.cpp
 
 HEADERS  += \
     img_viewer.h \
@@ -41,4 +54,11 @@ HEADERS  += \
     tiny_obj_loader.h \
     vec4.h \
     rast_main.h \
-    img_proc.h
+    img_proc.h \
+    thread_pool.h \
+    tile_raster.h \
+    span_raster.h \
+    vertex_stage.h \
+    render_context.h \
+    mesh_cache.h \
+    render_worker.h
@@ -590,11 +590,13 @@ img_t *resize(img_t *img,int w_new,int h_new){
         double c_old = floor(cf);
         double del_r = rf-r_old;
         double del_c = cf-c_old;
-        //Finding the 4 locations from img->data to add for interpolation
+        //Finding the 4 locations from img->data to add for interpolation (the last row and column are repeated past the edge)
+        int r_next = ((int)r_old + 1 < img->h) ? (int)r_old + 1 : (int)r_old;
+        int c_next = ((int)c_old + 1 < img->w) ? (int)c_old + 1 : (int)c_old;
         pixel_t *v1 = img->data + (((int)r_old)*img->w) + ((int)c_old);
-        pixel_t *v2 = img->data + (((int)r_old + 1)*img->w) + ((int)c_old);
-        pixel_t *v3 = img->data + (((int)r_old)*img->w) + ((int)c_old + 1);
-        pixel_t *v4 = img->data + (((int)r_old + 1)*img->w) + ((int)c_old + 1);
+        pixel_t *v2 = img->data + (r_next*img->w) + ((int)c_old);
+        pixel_t *v3 = img->data + (((int)r_old)*img->w) + c_next;
+        pixel_t *v4 = img->data + (r_next*img->w) + c_next;
         //Set value of new pixel using the data from the 4 locations above
         p->r = (unsigned char)round((((double)v1->r)*(1-del_r)*(1-del_c))+
                                (((double)v2->r)*(del_r)*(1-del_c))+
@@ -5,19 +5,39 @@
 #include <QtWidgets>
 //#include <QSize>
 #include "img_viewer.h"
-#include "rast_main.h"
+#include "render_worker.h"
 #include "raster_tools.h"
 #include "img_proc.h"
 #include <iostream>
+#include <algorithm>
+
+// Widget painting a QImage as it is
+FrameView::FrameView(const QImage *frame, QWidget *parent) : QWidget(parent), frame(frame){
+}
+
+QSize FrameView::sizeHint() const{
+    return frame->size();
+}
+
+void FrameView::paintEvent(QPaintEvent *){
+    QPainter painter(this);
+    painter.drawImage(0, 0, *frame);
+}
 
 //Define the constructor
 ImageViewer::ImageViewer(QWidget *parent) : QMainWindow(parent){
 
-  //  Define a pixmap and a label to put it in
-  img = new QPixmap(600,600);
-  img->fill(Qt::blue);
-  imgLabel = new QLabel(this);
-  imgLabel->setPixmap(*img);
+  //  Define the image and the widget to show it in
+  frame = QImage(600, 600, QImage::Format_RGB32);
+  frame.fill(Qt::blue);
+  imgLabel = new FrameView(&frame, this);
+  imgLabel->setFixedSize(frame.size());
+
+  // Set up the render thread that is reused by every render, and show its images as they come
+  use_prepass = use_deferred = use_adaptive = false;
+  msaa_samples = 1;
+  worker = new RenderWorker(this);
+  connect(worker, SIGNAL(frameReady(QImage)), this, SLOT(showFrame(QImage)));
 
   // Setup the text boxes
   camFile = new QPlainTextEdit(tr("Camera File"));
@@ -52,6 +72,20 @@ ImageViewer::ImageViewer(QWidget *parent) : QMainWindow(parent){
   bary = new QRadioButton(tr("&Barycentric"));
   bary_z = new QRadioButton(tr("&Barycentric_corrected"));
 
+  // Set up the check box to draw the depths before shading
+  prepass = new QCheckBox("&Depth prepass", this);
+
+  // Set up the check box to shade from a visibility buffer, which lets a new shading option skip the rasterization
+  deferred = new QCheckBox("D&eferred shading", this);
+
+  // Set up the combo box to pick the number of samples per pixel (the index i gives 2^i samples) or adaptive supersampling
+  msaa = new QComboBox(this);
+  msaa->addItem(tr("Off"));
+  msaa->addItem(tr("2x"));
+  msaa->addItem(tr("4x"));
+  msaa->addItem(tr("8x"));
+  msaa->addItem(tr("Adaptive"));
+
   // Set up check box for image processing options
   gray = new QCheckBox("&Grayscale", this);
   flip = new QCheckBox("&Flip", this);
@@ -124,6 +158,7 @@ ImageViewer::ImageViewer(QWidget *parent) : QMainWindow(parent){
 
 //Define the destructor
 ImageViewer::~ImageViewer() {
+    delete worker;
 }
 
 //Define the slots for the file menu actions
@@ -179,35 +214,47 @@ void ImageViewer::updateParams(){
     setSpinValues();
 }
 
-// Slot that rasterizes and performs the image operations, writes the image to the Pixmap and displays to labels
+// Slot that hands the render and the image operations to the render thread. The window stays responsive meanwhile.
 void ImageViewer::rasterize(){
+    submitRender(false);
+}
+
+// Method that copies the settings of the widgets into a render job and queues it
+void ImageViewer::submitRender(bool progressive){
     getSpinValues();
     float params[] = {left,right,top,bottom,ne,fa,eye_x,eye_y,eye_z,center_x,center_y,center_z,up_x,up_y,up_z};
-    // Check out QPrintable(QString) as an alternative.
-    QByteArray ba = curObj.toLocal8Bit();
-    char *ObjDat = ba.data();
-    QByteArray ba2 = curOpt.toLocal8Bit();
-    char *OptDat = ba2.data();
-//    char outputF[] = "temp_output.ppm";
-    img_t *rast_img = raster(ObjDat, params, int(img->width()), int(img->height()), OptDat);
-
-    rast_img = process_image(rast_img, applyProc, win_size->value(), ang->value(), sig->value());
 
-    // Convert the img_t format struct to a QImage type
-    QImage fin_im((unsigned char *)rast_img->data,rast_img->w,rast_img->h,(rast_img->w)*sizeof(pixel_t),QImage::Format_RGB888);
-    // Convert from QImage to QPixmap
-    *img = img->fromImage(fin_im);
-
-//    write_ppm(rast_img, outputF);
-
-//    if(!img->load("temp_output.ppm")){
-//            qWarning("Failed to load");
-//    }
+    render_job job;
+    job.obj_file = curObj;
+    job.opt = curOpt;
+    std::copy(params, params + 15, job.cam_params);
+    job.w = 600;  // Size of the render (the displayed image can differ after processing)
+    job.h = 600;
+    job.prepass = use_prepass;
+    job.deferred = use_deferred;
+    job.msaa = msaa_samples;
+    job.adaptive = use_adaptive;
+    std::copy(applyProc, applyProc + 9, job.apply_proc);
+    job.win_size = win_size->value();
+    job.ang = ang->value();
+    job.sig = sig->value();
+    job.progressive = progressive;
+    job.scale = 1;
 
+    worker->submit(job);
+}
 
-    imgLabel->setPixmap(*img);
+// Slot that displays a finished render (processing may change its size)
+void ImageViewer::showFrame(const QImage &image){
+    frame = image;
+    if(imgLabel->size() != frame.size()) imgLabel->setFixedSize(frame.size());
+    imgLabel->update();
+}
 
-    destroy_img(&rast_img);
+// Slot that renders again as soon as a camera parameter changes. A render still running is cancelled. A low resolution
+// preview is shown first and then refined, so the image follows the spin box without waiting for the full render.
+void ImageViewer::cameraChanged(){
+    if(!curObj.isEmpty()) submitRender(true);
 }
 
 // Slots to update the shading option passed to the rasterizer
@@ -239,6 +286,22 @@ void ImageViewer::setbary_z(){
     setCurrentOpt(QString("--norm_bary_z"));
 }
 
+// Slot to switch the depth prepass of the render context on and off
+void ImageViewer::setprepass(int state){
+    use_prepass = (state != Qt::Unchecked);
+}
+
+// Slot to switch deferred shading on and off. While it is on, changing only the shading option re-shades without rasterizing.
+void ImageViewer::setdeferred(int state){
+    use_deferred = (state != Qt::Unchecked);
+}
+
+// Slot to pick the number of samples per pixel used to anti-alias the edges, or to refine only the edge pixels
+void ImageViewer::setmsaa(int index){
+    use_adaptive = (index == 4);
+    msaa_samples = use_adaptive ? 1 : (1 << index);
+}
+
 // Slots to check the options for image processing
 void ImageViewer::gray_im(int state){
     if (state == Qt::Unchecked) {
@@ -346,6 +409,9 @@ void ImageViewer::createActions()
     connect(gour_z, SIGNAL( clicked() ), this, SLOT(setgour_z()));
     connect(bary, SIGNAL( clicked() ), this, SLOT(setbary()));
     connect(bary_z, SIGNAL( clicked() ), this, SLOT(setbary_z()));
+    connect(prepass, SIGNAL(stateChanged(int)),this, SLOT(setprepass(int)));
+    connect(deferred, SIGNAL(stateChanged(int)),this, SLOT(setdeferred(int)));
+    connect(msaa, SIGNAL(currentIndexChanged(int)),this, SLOT(setmsaa(int)));
 
     connect(gray, SIGNAL(stateChanged(int)),this, SLOT(gray_im(int)));
     connect(flip, SIGNAL(stateChanged(int)),this, SLOT(flip_im(int)));
@@ -358,6 +424,13 @@ void ImageViewer::createActions()
     connect(sobel, SIGNAL(stateChanged(int)),this, SLOT(sob_im(int)));
 
     connect(RastButton, SIGNAL (released()),this, SLOT (rasterize()));
+
+    QDoubleSpinBox *camBoxes[] = {leftSpinBox, rightSpinBox, topSpinBox, bottomSpinBox, nearSpinBox, farSpinBox, eye_xSpinBox,
+                                  eye_ySpinBox, eye_zSpinBox, center_xSpinBox, center_ySpinBox, center_zSpinBox, up_xSpinBox,
+                                  up_ySpinBox, up_zSpinBox};
+    for(int i = 0; i < 15; i++){
+        connect(camBoxes[i], SIGNAL(valueChanged(double)), this, SLOT(cameraChanged()));
+    }
 }
 
 // Methods to setup the layout of the menu, parameter spin box, shading options group box and image processing
@@ -506,6 +579,10 @@ void ImageViewer::createRadioGroup(){
     gbox->addWidget(gour_z,0,4);
     gbox->addWidget(bary,0,5);
     gbox->addWidget(bary_z,0,6);
+    gbox->addWidget(prepass,1,0);
+    gbox->addWidget(deferred,1,1);
+    gbox->addWidget(new QLabel(tr("Anti-aliasing")),1,2);
+    gbox->addWidget(msaa,1,3);
 
     RadioGroup->setLayout(gbox);
 
@@ -597,7 +674,7 @@ bool ImageViewer::saveFile(const QString &fileName)
         return false;
     }
 
-    img->save(&file, "PNG");
+    frame.save(&file, "PNG");
 
     setCurrentOutFile(fileName);
     statusBar()->showMessage(tr("File saved"), 2000);
@@ -9,6 +9,8 @@
 #include <QActionGroup>
 #include <QMenu>
 #include <QPlainTextEdit>
+#include <QImage>
+#include <QWidget>
 class QDateTimeEdit;
 class QSpinBox;
 class QDoubleSpinBox;
@@ -17,6 +19,23 @@ class QLabel;
 class QPushButton;
 class QRadioButton;
 class QCheckBox;
+class QComboBox;
+class RenderWorker;
+
+// Widget painting a QImage as it is, without keeping a copy. Painting a Format_RGB32 image needs no conversion.
+class FrameView : public QWidget {
+public:
+    explicit FrameView(const QImage *frame, QWidget *parent = 0);
+
+    // Preferred size: the size of the image
+    QSize sizeHint() const;
+
+protected:
+    void paintEvent(QPaintEvent *event);
+
+private:
+    const QImage *frame;
+};
 
 // ":" is just like "extends" in Java
 class ImageViewer : public QMainWindow {
@@ -46,9 +65,15 @@ private slots:
     bool save();
     bool saveAs();
 
-    // Slot to rasterize and apply the image processing code.
+    // Slot to rasterize and apply the image processing code. The render runs in the background and showFrame displays it.
     void rasterize();
 
+    // Slot to display a finished render
+    void showFrame(const QImage &image);
+
+    // Slot for the camera spin boxes: render again progressively once an object is loaded
+    void cameraChanged();
+
     // Slots for the radio buttons
     void setdef();
     void setflat();
@@ -58,6 +83,13 @@ private slots:
     void setbary();
     void setbary_z();
 
+    // Slots for the depth prepass and deferred shading check boxes
+    void setprepass(int state);
+    void setdeferred(int state);
+
+    // Slot for the multisampling combo box
+    void setmsaa(int index);
+
     //Slots for the check boxes
     void gray_im(int state);
     void flip_im(int state);
@@ -73,11 +105,21 @@ private slots:
     void updateParams();
 
 private:
-    //  QLabel is typically used for displaying text, but it can also display an image.
-    QLabel *imgLabel;
+    // Widget displaying the image
+    FrameView *imgLabel;
+
+    // The displayed image (Format_RGB32), shared with the render thread which drew it
+    QImage frame;
+
+    // Renders in the background. A new render cancels the one in progress.
+    RenderWorker *worker;
+
+    // Render settings of the check boxes and the anti-aliasing combo box
+    bool use_prepass, use_deferred, use_adaptive;
+    int msaa_samples;
 
-    // Variable to store the image
-    QPixmap *img;
+    // Hand a render with the current settings to the render thread (with previews first when progressive)
+    void submitRender(bool progressive);
 
     //  Functions for text boxes and menus
     void createActions();
@@ -128,6 +170,8 @@ private:
     void createRadioGroup();
     QGroupBox *RadioGroup;
     QRadioButton *def, *whit, *flat, *gour, *gour_z, *bary, *bary_z;
+    QCheckBox *prepass, *deferred;
+    QComboBox *msaa;
 
     //Image processing options
     void createProcGroup();
@@ -0,0 +1,114 @@
+// Binary mesh cache. The first time an OBJ file is loaded its parsed shapes are written next to it
+// (wahoo.obj -> wahoo.obj.rmesh). Later loads map the cache file into memory and point the mesh views
+// straight into it, so there is no parsing and no copying before the vertex stage.
+//
+// File layout (all sections start on a MESH_CACHE_ALIGN byte boundary):
+//   mesh_cache_header
+//   mesh_cache_shape     x n_shapes
+//   mesh_cache_material  x n_materials
+//   mesh_cache_source    x n_mtl_files
+//   positions, normals, indices and material ids of every shape
+
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include <string>
+#include "raster_tools.h"
+
+/// Identifies a cache file (and its version)
+#define MESH_CACHE_MAGIC "RMESH02"
+
+/// Alignment of every section in the file
+#define MESH_CACHE_ALIGN 64
+
+/// Extension added to the OBJ file name
+#define MESH_CACHE_EXT ".rmesh"
+
+/// Longest .mtl path recorded in the cache (no cache is written for longer ones)
+#define MESH_CACHE_PATH_MAX 256
+
+/// Size recorded for a .mtl file that did not exist when the cache was made
+#define MESH_CACHE_MISSING (~0ULL)
+
+/// Start of the file
+struct mesh_cache_header{
+  char magic[8]; // MESH_CACHE_MAGIC
+  unsigned long long src_size; // Size of the OBJ file the cache was made from
+  long long src_mtime; // Modification time of the OBJ file the cache was made from
+  unsigned long long file_size; // Size of the cache file
+  unsigned int n_shapes; // Number of shapes
+  unsigned int n_materials; // Number of materials
+  unsigned int n_mtl_files; // Number of .mtl files referenced by the OBJ file
+  unsigned int reserved; // Zero
+};
+
+/// A .mtl file the materials were read from. The cache is only used while it is unchanged.
+struct mesh_cache_source{
+  unsigned long long size; // Size of the file (MESH_CACHE_MISSING if it did not exist)
+  long long mtime; // Modification time of the file
+  char path[MESH_CACHE_PATH_MAX]; // Path as opened by the OBJ loader, zero terminated
+};
+
+/// Location of the data of a shape. Offsets are in bytes from the start of the file, counts are in elements.
+struct mesh_cache_shape{
+  unsigned long long positions, n_positions; // floats, 3 per vertex
+  unsigned long long normals, n_normals; // floats, 3 per vertex
+  unsigned long long indices, n_indices; // unsigned ints, 3 per triangle
+  unsigned long long material_ids, n_material_ids; // ints, 1 per triangle
+};
+
+/// Material properties used for shading (names and texture names are not cached)
+struct mesh_cache_material{
+  float ambient[3];
+  float diffuse[3];
+  float specular[3];
+  float transmittance[3];
+  float emission[3];
+  float shininess;
+  float ior;
+  float dissolve;
+  int illum;
+};
+
+/// A cache file mapped into memory
+class mesh_cache {
+private:
+    ///The mapped file
+    void *data;
+    size_t size;
+
+    /// Not copyable (owns the mapping)
+    mesh_cache(const mesh_cache &);
+    mesh_cache &operator=(const mesh_cache &);
+
+public:
+    ///----------------------------------------------------------------------
+    /// Constructors
+    ///----------------------------------------------------------------------
+
+    /// Create a cache with nothing mapped
+    mesh_cache();
+
+    /// Unmap the file
+    ~mesh_cache();
+
+    ///----------------------------------------------------------------------
+    /// Methods
+    ///----------------------------------------------------------------------
+
+    /// Map the cache of obj_file if it exists and was made from the current version of obj_file and of its .mtl files
+    /// (same size and modification time).
+    /// On success the views of the shapes point into the mapping and the materials are filled in. Returns false otherwise.
+    bool open(const char *obj_file, vector<mesh_view> &meshes, vector<tinyobj::material_t> &materials);
+
+    /// Unmap the file. The views from open() are no longer valid afterwards.
+    void close();
+};
+
+/// Path of the cache file of an OBJ file
+std::string mesh_cache_path(const char *obj_file);
+
+/// Write the cache file of obj_file from its parsed shapes and materials. Returns false if it could not be written.
+bool write_mesh_cache(const char *obj_file, vector<tinyobj::shape_t> &shapes, vector<tinyobj::material_t> &materials);
+
+#endif // MESH_CACHE_H
@@ -2,7 +2,11 @@
 #define RAST_MAIN_H
 
 #include "raster_tools.h"
+#include "render_context.h"
 
-img_t *raster(char *obj_file,float *cam_params,int w,int h,char *opt);
+img_t *raster(RenderContext &ctx, char *obj_file,float *cam_params,int w,int h,char *opt);
+
+// Same, drawing straight into a 32-bit image owned by the caller (at its size)
+void raster(RenderContext &ctx, char *obj_file, float *cam_params, img32_t &target, char *opt);
 
 #endif // RAST_MAIN_H
@@ -0,0 +1,138 @@
+#include "render_worker.h"
+#include "rast_main.h"
+#include "img_proc.h"
+#include <algorithm>
+
+// The context uses one thread per core. The render thread is one of them while the tiles are drawn.
+RenderWorker::RenderWorker(QObject *parent) : QObject(parent), ctx(std::max(1, (int)std::thread::hardware_concurrency())),
+    next(0), has_pending(false), quit(false){
+    thread = std::thread(&RenderWorker::run, this);
+}
+
+RenderWorker::~RenderWorker(){
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        quit = true;
+    }
+    ctx.cancel();
+    wake.notify_one();
+    thread.join();
+}
+
+void RenderWorker::submit(const render_job &job){
+    {
+        // The job in progress stops at its next tile and its image is dropped. The cancel is made under the lock so
+        // that it either reaches the job in progress or is cleared when this job is taken, never stopping this job.
+        std::lock_guard<std::mutex> guard(lock);
+        pending = job;
+        has_pending = true;
+        ctx.cancel();
+    }
+    wake.notify_one();
+}
+
+void RenderWorker::run(){
+    for(;;){
+        render_job job;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [this]{ return has_pending || quit; });
+            if(quit) return;
+            job = pending;
+            has_pending = false;
+            ctx.clear_cancel();
+        }
+
+        for(int pass = 0; pass < n_passes(job); pass++){
+            {
+                // A newer job is waiting: skip the passes left
+                std::lock_guard<std::mutex> guard(lock);
+                if(has_pending || quit) break;
+            }
+            render(pass_job(job, pass), frames[next]);
+
+            // Only send the image when nothing newer has been asked for, otherwise the remaining passes are dropped too.
+            // The receiver gets a shared copy, so the next pass goes to the other image and this one is left alone while it is shown.
+            std::lock_guard<std::mutex> guard(lock);
+            if(ctx.cancelled() || has_pending || quit) break;
+            emit frameReady(frames[next]);
+            next = 1 - next;
+        }
+    }
+}
+
+int RenderWorker::n_passes(const render_job &job){
+    if(!job.progressive) return 1;
+    return ((job.msaa > 1) || job.adaptive) ? 4 : 3;
+}
+
+render_job RenderWorker::pass_job(const render_job &job, int pass){
+    render_job p = job;
+    if(pass == n_passes(job) - 1) return p;
+
+    // The previews are neither anti-aliased nor processed
+    p.msaa = 1;
+    p.adaptive = false;
+    std::fill(p.apply_proc, p.apply_proc + 9, 0);
+    if(pass == 0){
+        p.scale = PREVIEW_SCALE;
+        p.opt = "--norm_flat";
+    }
+    else if(pass == 1){
+        p.scale = 2;
+    }
+    return p;
+}
+
+void RenderWorker::render(const render_job &job, QImage &image){
+    ctx.set_prepass(job.prepass);
+    ctx.set_deferred(job.deferred);
+    ctx.set_msaa(job.msaa);
+    ctx.set_adaptive(job.adaptive);
+
+    float params[15];
+    std::copy(job.cam_params, job.cam_params + 15, params);
+    int applyProc[9];
+    std::copy(job.apply_proc, job.apply_proc + 9, applyProc);
+    QByteArray ba = job.obj_file.toLocal8Bit();
+    char *ObjDat = ba.data();
+    QByteArray ba2 = job.opt.toLocal8Bit();
+    char *OptDat = ba2.data();
+
+    bool processing = (job.scale > 1);
+    for(int i = 0; i < 9; i++){
+        if(job.apply_proc[i]) processing = true;
+    }
+
+    if(!processing){
+        // Draw straight into the pixels of the image: no conversion, and no allocation unless the size changed
+        if((image.width() != job.w) || (image.height() != job.h)){
+            image = QImage(job.w, job.h, QImage::Format_RGB32);
+        }
+        img32_t target = {(unsigned int *)image.bits(), image.width(), image.height(), image.bytesPerLine() / 4};
+        raster(ctx, ObjDat, params, target, OptDat);
+        return;
+    }
+
+    // The rendered image belongs to the render context. Image processing replaces the image it is given so work on a copy.
+    img_t *rast_img = raster(ctx, ObjDat, params, job.w / job.scale, job.h / job.scale, OptDat);
+    // NULL when the job was cancelled before the render started
+    if(ctx.cancelled() || (rast_img == NULL)) return;
+    rast_img = copy_img(rast_img);
+    if(job.scale > 1) rast_img = resize(rast_img, job.w, job.h);
+    rast_img = process_image(rast_img, applyProc, job.win_size, job.ang, job.sig);
+
+    // Copy the result into the image (processing may change its size)
+    if((image.width() != rast_img->w) || (image.height() != rast_img->h)){
+        image = QImage(rast_img->w, rast_img->h, QImage::Format_RGB32);
+    }
+    for(int y = 0; y < rast_img->h; y++){
+        QRgb *row = (QRgb *)image.scanLine(y);
+        const pixel_t *p = rast_img->data + (y * rast_img->w);
+        for(int x = 0; x < rast_img->w; x++){
+            row[x] = qRgb(p[x].r, p[x].g, p[x].b);
+        }
+    }
+
+    destroy_img(&rast_img);
+}
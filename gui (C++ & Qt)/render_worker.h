@@ -0,0 +1,85 @@
+#ifndef RENDER_WORKER_H
+#define RENDER_WORKER_H
+
+#include <QObject>
+#include <QImage>
+#include <QString>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "render_context.h"
+
+// The first preview of a progressive render is drawn at 1/PREVIEW_SCALE of the size with --norm_flat
+#define PREVIEW_SCALE 4
+
+// Everything a render needs, copied from the widgets when the render is asked for
+struct render_job{
+    QString obj_file;           // OBJ file to draw
+    QString opt;                // Shading option (--norm_bary_z, ...)
+    float cam_params[15];       // Camera parameters in the order of the camera file
+    int w, h;                   // Size of the image
+    bool prepass, deferred;     // Depth prepass and deferred shading
+    int msaa;                   // Samples per pixel (1 turns multisampling off)
+    bool adaptive;              // Adaptive supersampling of the edge pixels
+    int apply_proc[9];          // Image processing options, as in process_image
+    int win_size;               // Radius, angle and sigma of the image processing
+    float ang, sig;
+    bool progressive;           // Send quick previews before the final image
+    int scale;                  // Draw at w / scale x h / scale and scale the image up to w x h (1 for full size)
+};
+
+// Renders on a thread of its own so that the window stays responsive, and sends every finished image back with frameReady.
+// The queue holds at most one job: a new job replaces the one waiting and cancels the one being drawn, which stops
+// after the tiles already started. Images of cancelled or replaced jobs are never sent.
+// A progressive job is drawn in passes that are each sent as they finish: a 1/PREVIEW_SCALE size preview with the
+// cheapest shading, a half size image, the full size image and, with anti-aliasing, the anti-aliased image.
+// The previews are scaled up with resize and image processing is only applied to the last pass.
+class RenderWorker : public QObject {
+    Q_OBJECT
+
+public:
+
+    // Start the thread (it waits for jobs)
+    explicit RenderWorker(QObject *parent = 0);
+
+    // Cancel the render in progress and join the thread
+    virtual ~RenderWorker();
+
+    // Queue a render in place of the one waiting and cancel the one in progress. Called from the GUI thread.
+    void submit(const render_job &job);
+
+signals:
+
+    // A job finished. Emitted from the render thread, so connected slots run in the thread of the receiver.
+    void frameReady(const QImage &image);
+
+private:
+    // Loop of the render thread: take the latest job, draw it and send the image
+    void run();
+
+    // Number of passes of a job, and the settings of one of them
+    static int n_passes(const render_job &job);
+    static render_job pass_job(const render_job &job, int pass);
+
+    // Draw a job into image (at the size of the job, or of the processed image)
+    void render(const render_job &job, QImage &image);
+
+    // Keeps the parsed mesh and the render buffers between jobs. Only used by the render thread (except cancel).
+    RenderContext ctx;
+
+    // The image of the last job sent is shown while the next one is drawn into the other
+    QImage frames[2];
+    int next;
+
+    // Job waiting to be drawn, and the lock and signal guarding it
+    std::mutex lock;
+    std::condition_variable wake;
+    render_job pending;
+    bool has_pending;
+    bool quit;
+
+    // Started last, once everything it uses is set up
+    std::thread thread;
+};
+
+#endif // RENDER_WORKER_H
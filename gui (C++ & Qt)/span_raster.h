@@ -0,0 +1,464 @@
+// A single span rasterizer shared by all the shading modes.
+// The way a mode colors its pixels is described by a shader policy whose traits are known at compile time,
+// so every mode gets its own specialized copy of the span loop with the unused work removed.
+
+#ifndef SPAN_RASTER_H
+#define SPAN_RASTER_H
+
+#include "raster_tools.h"
+#include <math.h>
+
+///----------------------------------------------------------------------
+/// Shader policies
+///----------------------------------------------------------------------
+
+/// Default traits. Shaders override the ones they need.
+struct shader_base{
+  static const bool normal = false; // Color each pixel from its interpolated normal
+  static const bool bary = true;    // Step the attributes with the plane gradients (false: interpolate between the span edges as in gouraud shading)
+  static const bool persp = false;  // Perspective correct the interpolated normal
+
+  /// Color of the whole triangle (used when normal is false)
+  static void tri_color(face &f, tinyobj::material_t &materials, unsigned int *color){
+    color[0] = 255;
+    color[1] = 255;
+    color[2] = 255;
+  }
+};
+
+/// Coloring using the diffuse property in the materials object
+struct material_shader : shader_base{
+  static void tri_color(face &f, tinyobj::material_t &materials, unsigned int *color){
+    for(unsigned int i = 0; i < 3; i++){
+      color[i] = (unsigned int)round(materials.diffuse[i]*255.0);
+    }
+  }
+};
+
+/// Coloring all the pixels in the triangle white
+struct white_shader : shader_base{};
+
+/// Coloring all the pixels using the normal of the 1st vertex
+struct flat_shader : shader_base{
+  static void tri_color(face &f, tinyobj::material_t &materials, unsigned int *color){
+    get_color(color, f.n1);
+  }
+};
+
+/// Coloring using the interpolated normal of every pixel
+template <bool BARY, bool PERSP>
+struct normal_shader : shader_base{
+  static const bool normal = true;
+  static const bool bary = BARY;
+  static const bool persp = PERSP;
+};
+
+///----------------------------------------------------------------------
+/// Span rasterizer
+///----------------------------------------------------------------------
+
+/// What a call to span_fill writes
+enum fill_pass{
+  PASS_COLOR, // Depth test, color and depth of the nearest pixels so far (single pass)
+  PASS_DEPTH, // Depth test and depth only (first pass of a depth prepass)
+  PASS_SHADE, // Color of the pixels whose depth equals the one stored by PASS_DEPTH (second pass of a depth prepass)
+  PASS_VIS,   // Depth test, depth and the visible triangle and shape (visibility buffer for deferred shading, no color)
+  PASS_MSAA,  // Coverage and depth test of every sample and color of the samples that pass (drawn by sample_fill)
+  PASS_SUPER  // Same for the samples of the pixels refined by adaptive supersampling, shading each sample (drawn by sample_fill)
+};
+
+/// Signature shared by all the specializations of span_fill
+typedef img_t *(*shade_fn)(img_t *img, vector<face> &triangles, unsigned int shape, tinyobj::material_t &materials,
+                           z_buffer &zb, vector<unsigned int> &ids, rect clip, render_stats &stats);
+
+/// Fill the pixels covered by the triangles listed in ids (only inside clip) using the shader policy S.
+/// The depths and colors go to the tiled framebuffer of zb (the image itself is written by pack_img).
+/// triangles is the list of shape number shape (only used by PASS_VIS, which records it in the visibility buffer).
+/// Triangles and rows of pixels behind the hierarchical Z-buffer are skipped (counted in stats).
+/// PASS_DEPTH leaves in ids only the triangles that wrote a depth, the only ones PASS_SHADE then has to walk.
+/// PASS_DEPTH stores the depths it writes negated. PASS_SHADE colors a pixel only while its depth is still negated and
+/// then stores it as is, so that every pixel is colored once: not again by a triangle at the same depth, nor by a
+/// later batch of triangles (whose depth pass only negates the depths it brings nearer).
+template <class S, fill_pass P>
+img_t *span_fill(img_t *img, vector<face> &triangles, unsigned int shape, tinyobj::material_t &materials,
+                 z_buffer &zb, vector<unsigned int> &ids, rect clip, render_stats &stats){
+
+    int w = img->w;
+
+    // Initialize various container variables
+    edge_walk e;
+    tri_setup s;
+    int x_start, x_stop, y;
+    float z_cur, z_step, z_end, z_near, iw_row = 1, iw_step = 0;
+    int passed;
+    bool wrote;
+    unsigned int kept = 0;
+    vec4 a_row, a_step; // Normal (or normal/w when perspective correcting)
+    unsigned int color[3];
+
+    //Loop through the triangles listed in ids
+    for(unsigned int t = 0; t < ids.size(); t++){
+
+        unsigned int i = ids[t];
+
+        // Set up the edge functions. Skip the triangle if it does not cover any pixel in the clip window.
+        if(!edge_setup(e, triangles[i], clip)) continue;
+
+        // Skip the triangle if its nearest vertex is behind the farthest depth of every block it overlaps in the clip window.
+        // The shading pass has no use for it: the depth pass already left out the triangles that are hidden.
+        face &f = triangles[i];
+        if(P != PASS_SHADE){
+            stats.hiz_triangles++;
+            z_near = near_z(f);
+            if(z_near > block_max_z(zb, e.x0 / HIZ_SIZE, e.y / HIZ_SIZE, e.x1 / HIZ_SIZE, e.y1 / HIZ_SIZE)){
+                stats.hiz_culled_triangles++;
+                continue;
+            }
+        }
+        wrote = false;
+
+        // Set up the plane equations of the attributes once for the triangle
+        tri_plane_setup(s, triangles[i], e.x0, e.y);
+
+        // Color shared by all the pixels of the triangle
+        if(!S::normal && (P != PASS_DEPTH) && (P != PASS_VIS)) S::tri_color(triangles[i], materials, color);
+
+        // Loop through the rows of pixels covered by the triangle
+        while(next_span(e, y, x_start, x_stop)){
+
+            // Depth at the two ends of the row. Gouraud shading interpolates linearly between them.
+            z_cur = plane_at(s.z, s.dzdx, s.dzdy, x_start - s.x0, y - s.y0);
+            z_end = plane_at(s.z, s.dzdx, s.dzdy, x_stop - s.x0, y - s.y0);
+            z_step = s.dzdx;
+            if(S::normal && !S::bary && (x_stop > x_start)){
+                z_step = (z_end - z_cur) / (x_stop - x_start);
+            }
+
+            // Skip the row if both its ends (so every pixel, the depth being linear) are behind the blocks it crosses
+            if(P != PASS_SHADE){
+                stats.hiz_spans++;
+                z_near = min(z_cur, z_end);
+                if(z_near > block_max_z(zb, x_start / HIZ_SIZE, y / HIZ_SIZE, x_stop / HIZ_SIZE, y / HIZ_SIZE)){
+                    stats.hiz_culled_spans++;
+                    continue;
+                }
+            }
+
+            // Attributes at the first pixel of the row and their change per pixel
+            if(S::normal && (P != PASS_DEPTH) && (P != PASS_VIS)){
+                if(S::persp){
+                    iw_row = plane_at(s.iw, s.diwdx, s.diwdy, x_start - s.x0, y - s.y0);
+                    iw_step = s.diwdx;
+                    a_row = plane_at(s.nw, s.dnwdx, s.dnwdy, x_start - s.x0, y - s.y0);
+                    a_step = s.dnwdx;
+                }
+                else{
+                    a_row = plane_at(s.n, s.dndx, s.dndy, x_start - s.x0, y - s.y0);
+                    a_step = s.dndx;
+                }
+
+                // Interpolate linearly between the values at the two edges of the row (first and last pixel)
+                if(!S::bary && (x_stop > x_start)){
+                    if(S::persp){
+                        iw_step = (plane_at(s.iw, s.diwdx, s.diwdy, x_stop - s.x0, y - s.y0) - iw_row) / (x_stop - x_start);
+                        a_step = (plane_at(s.nw, s.dnwdx, s.dnwdy, x_stop - s.x0, y - s.y0) - a_row) / (x_stop - x_start);
+                    }
+                    else{
+                        a_step = (plane_at(s.n, s.dndx, s.dndy, x_stop - s.x0, y - s.y0) - a_row) / (x_stop - x_start);
+                    }
+                }
+            }
+            passed = 0;
+
+            // The row is stored in pieces of up to HIZ_SIZE contiguous pixels, one in each block it crosses.
+            // Only the depth is stepped along the row. The other attributes are only computed for the pixels passing the depth test.
+            for(int x0 = x_start; x0 <= x_stop; x0 = ((x0 / HIZ_SIZE) + 1) * HIZ_SIZE){
+                int x1 = min(x_stop, (((x0 / HIZ_SIZE) + 1) * HIZ_SIZE) - 1);
+                fb_pixel *q = &zb.fb[fb_index(zb, x0, y)];
+
+                for(int x = x0; x <= x1; x++, q++){
+
+                    //Depth only: the depth is the only thing read and written
+                    if(P == PASS_DEPTH){
+                        if((z_cur<fabs(q->z)) && (z_cur>0) && (z_cur<1)){
+                            q->z = -z_cur;
+                            passed++;
+                        }
+                    }
+
+                    //Visibility: the depth and the ids of the triangle, to be shaded later
+                    else if(P == PASS_VIS){
+                        if((z_cur<q->z) && (z_cur>0) && (z_cur<1)){
+                            q->z = z_cur;
+                            zb.tri[(y*w) + x] = i;
+                            zb.shape[(y*w) + x] = shape;
+                            passed++;
+                        }
+                    }
+
+                    // Single pass: if the depth is within range and lower than current depth value in the buffer update the pixel color and depth.
+                    // Shading pass: only color the pixel if this triangle is the one that left its depth in the buffer.
+                    else if((P == PASS_SHADE) ? (-z_cur == q->z) : ((z_cur<q->z) && (z_cur>0) && (z_cur<1))){
+                        q->z = z_cur;
+                        passed++;
+                        if(S::normal){
+                            float k = (float)(x - x_start);
+                            vec4 n = a_row + (a_step * k);
+                            if(S::persp) n = n / (iw_row + (iw_step * k));
+#ifdef NORMALIZE_NORMALS
+                            // Interpolated normals are shorter than 1. Rescale them before coloring.
+                            n[3] = 0;
+                            n.norm();
+#endif
+                            get_color(color, n);
+                        }
+                        q->r = color[0];
+                        q->g = color[1];
+                        q->b = color[2];
+                    }
+
+                    // Step the depth to the next pixel
+                    z_cur += z_step;
+                }
+            }
+            stats.pixels_tested += x_stop - x_start + 1;
+            if((P != PASS_DEPTH) && (P != PASS_VIS)) stats.pixels_shaded += passed;
+
+            // The farthest depth of the blocks the row wrote to may have come nearer
+            if((P != PASS_SHADE) && (passed > 0)){
+                unsigned char *dirty = &zb.dirty[(y / HIZ_SIZE) * zb.blocks_x];
+                for(int bx = x_start / HIZ_SIZE; bx <= x_stop / HIZ_SIZE; bx++) dirty[bx] = 1;
+            }
+            if(passed > 0) wrote = true;
+        }
+
+        // Keep the triangles that wrote a depth for the shading pass (in the same order)
+        if((P == PASS_DEPTH) && wrote) ids[kept++] = i;
+    }
+    if(P == PASS_DEPTH) ids.resize(kept);
+    return img;
+}
+
+///----------------------------------------------------------------------
+/// Multisampling and adaptive supersampling
+///----------------------------------------------------------------------
+
+/// Fill the samples covered by the triangles listed in ids (only inside clip) using the shader policy S.
+/// The pixels with samples (see sample_slot) have zb.samples of them placed as in msaa_pattern, and coverage and
+/// depth are tested at each sample. The colors are written to the samples until resolve_samples averages them
+/// into the framebuffer. Gouraud options shade like the barycentric ones.
+/// PASS_MSAA: every pixel has samples. A pixel is only shaded once per triangle, at its center, and that color goes
+/// to all the samples that passed. The depth buffer of the pixels keeps the farthest of their samples, which is what
+/// the hierarchical Z-buffer needs.
+/// PASS_SUPER: only the pixels picked by refine_pixels have samples, and each sample that passes is shaded at its own
+/// position. The pixel depths are left alone, so the hierarchical Z-buffer (which only knows the pixel centers) is not used.
+template <class S, fill_pass P>
+img_t *sample_fill(img_t *img, vector<face> &triangles, unsigned int shape, tinyobj::material_t &materials,
+                   z_buffer &zb, vector<unsigned int> &ids, rect clip, render_stats &stats){
+
+    int w = img->w, n = zb.samples;
+    const fx_pt *pattern = msaa_pattern(n);
+    if(pattern == NULL) return img;
+
+    // Nothing to refine in this part of the image
+    if(P == PASS_SUPER){
+        bool any = false;
+        for(int y = clip.y0; (y < clip.y1) && !any; y++){
+            for(int x = clip.x0; x < clip.x1; x++){
+                if(sample_slot(zb, ((size_t)y * w) + x) != VIS_NONE){
+                    any = true;
+                    break;
+                }
+            }
+        }
+        if(!any) return img;
+    }
+
+    edge_walk e;
+    tri_setup s;
+    long long c[3], off[MSAA_MAX_SAMPLES][3];
+    float z_off[MSAA_MAX_SAMPLES];
+    vec4 n_off[MSAA_MAX_SAMPLES];
+    float iw_off[MSAA_MAX_SAMPLES];
+    unsigned int color[3];
+
+    for(unsigned int t = 0; t < ids.size(); t++){
+
+        // Walk every pixel overlapping the triangle, since any of its samples may be covered
+        face &f = triangles[ids[t]];
+        if(!edge_setup(e, f, clip, true)) continue;
+
+        // Skip the triangle if it is behind the farthest sample of every block it overlaps
+        if(P == PASS_MSAA){
+            stats.hiz_triangles++;
+            if(near_z(f) > block_max_z(zb, e.x0 / HIZ_SIZE, e.y / HIZ_SIZE, e.x1 / HIZ_SIZE, e.y1 / HIZ_SIZE)){
+                stats.hiz_culled_triangles++;
+                continue;
+            }
+        }
+
+        tri_plane_setup(s, f, e.x0, e.y);
+        if(!S::normal) S::tri_color(f, materials, color);
+
+        // Change in the edge functions and the attributes from the center of a pixel to each of its samples.
+        // The steps of the edge functions per pixel are multiples of FX_ONE and the offsets are in 1/FX_ONE of a pixel.
+        for(int k = 0; k < n; k++){
+            float ox = (float)pattern[k].x / FX_ONE, oy = (float)pattern[k].y / FX_ONE;
+            for(int j = 0; j < 3; j++){
+                off[k][j] = ((e.a[j] / FX_ONE) * pattern[k].x) + ((e.b[j] / FX_ONE) * pattern[k].y);
+            }
+            z_off[k] = (s.dzdx * ox) + (s.dzdy * oy);
+            if(S::persp){
+                n_off[k] = (s.dnwdx * ox) + (s.dnwdy * oy);
+                iw_off[k] = (s.diwdx * ox) + (s.diwdy * oy);
+            }
+            else{
+                n_off[k] = (s.dndx * ox) + (s.dndy * oy);
+            }
+        }
+
+        for(int y = e.y; y <= e.y1; y++){
+            c[0] = e.row[0];
+            c[1] = e.row[1];
+            c[2] = e.row[2];
+            bool wrote = false;
+
+            for(int x = e.x0; x <= e.x1; x++, c[0] += e.a[0], c[1] += e.a[1], c[2] += e.a[2]){
+
+                size_t p = ((size_t)y * w) + x;
+                unsigned int slot = sample_slot(zb, p);
+                if(slot == VIS_NONE) continue;
+
+                // Samples inside all three edges (with the same fill rule bias as the pixel centers)
+                unsigned int mask = 0;
+                for(int k = 0; k < n; k++){
+                    if(((c[0] + off[k][0]) | (c[1] + off[k][1]) | (c[2] + off[k][2])) >= 0) mask |= 1u << k;
+                }
+                if(mask == 0) continue;
+                if(P == PASS_MSAA) stats.pixels_tested++;
+
+                // Depth test each covered sample. Multisampling shades the pixel when the first one passes.
+                float *sz = &zb.sample_z[(size_t)slot * n];
+                pixel_t *sc = &zb.sample_color[(size_t)slot * n];
+                float z_center = plane_at(s.z, s.dzdx, s.dzdy, x - s.x0, y - s.y0);
+                vec4 n_center;
+                float iw_center = 1;
+                if(S::normal){
+                    if(S::persp){
+                        n_center = plane_at(s.nw, s.dnwdx, s.dnwdy, x - s.x0, y - s.y0);
+                        iw_center = plane_at(s.iw, s.diwdx, s.diwdy, x - s.x0, y - s.y0);
+                    }
+                    else{
+                        n_center = plane_at(s.n, s.dndx, s.dndy, x - s.x0, y - s.y0);
+                    }
+                }
+                bool shaded = false;
+                for(int k = 0; k < n; k++){
+                    float z_cur = z_center + z_off[k];
+                    if(!(mask & (1u << k)) || !((z_cur<sz[k]) && (z_cur>0) && (z_cur<1))) continue;
+                    if(S::normal && ((P == PASS_SUPER) || !shaded)){
+                        vec4 nrm = n_center;
+                        if(P == PASS_SUPER) nrm = nrm + n_off[k];
+                        if(S::persp) nrm = nrm / ((P == PASS_SUPER) ? (iw_center + iw_off[k]) : iw_center);
+#ifdef NORMALIZE_NORMALS
+                        // Interpolated normals are shorter than 1. Rescale them before coloring.
+                        nrm[3] = 0;
+                        nrm.norm();
+#endif
+                        get_color(color, nrm);
+                    }
+                    if(P == PASS_SUPER) stats.samples_shaded++;
+                    shaded = true;
+                    sz[k] = z_cur;
+                    sc[k].r = color[0];
+                    sc[k].g = color[1];
+                    sc[k].b = color[2];
+                }
+                if(!shaded || (P == PASS_SUPER)) continue;
+                stats.pixels_shaded++;
+                wrote = true;
+
+                // The pixel depth is its farthest sample
+                float far_z = sz[0];
+                for(int k = 1; k < n; k++) far_z = max(far_z, sz[k]);
+                zb.fb[fb_index(zb, x, y)].z = far_z;
+            }
+
+            // The farthest depth of the blocks the row wrote to may have come nearer
+            if(wrote){
+                unsigned char *dirty = &zb.dirty[(y / HIZ_SIZE) * zb.blocks_x];
+                for(int bx = e.x0 / HIZ_SIZE; bx <= e.x1 / HIZ_SIZE; bx++) dirty[bx] = 1;
+            }
+            e.row[0] += e.b[0];
+            e.row[1] += e.b[1];
+            e.row[2] += e.b[2];
+        }
+    }
+    return img;
+}
+
+/// Pick the specialization of span_fill for a shading option (NULL or --default picks the material color) and a pass
+/// (PASS_MSAA and PASS_SUPER pick sample_fill). Returns NULL if the option is unknown.
+shade_fn get_shader(char *opt, fill_pass pass = PASS_COLOR);
+
+///----------------------------------------------------------------------
+/// Deferred shading
+///----------------------------------------------------------------------
+
+/// Signature shared by all the specializations of resolve_fill
+typedef void (*resolve_fn)(img_t *img, vector< vector<face> > &pix_triangles, vector<tinyobj::material_t> &materials,
+                           z_buffer &zb, rect clip);
+
+/// Color the pixels inside clip of the framebuffer of zb from its visibility buffer using the shader policy S (black where nothing was drawn).
+/// The attributes of each pixel come from the plane equations of its triangle, which are only set up again when the
+/// triangle changes along the row. Every pixel is shaded exactly once. Gouraud shading interpolates linearly along the
+/// rows of a triangle, which is the same plane, so the gouraud options give the barycentric result (up to rounding).
+template <class S>
+void resolve_fill(img_t *img, vector< vector<face> > &pix_triangles, vector<tinyobj::material_t> &materials,
+                  z_buffer &zb, rect clip){
+
+    int w = img->w;
+    tri_setup s;
+    unsigned int cur_tri = VIS_NONE, cur_shape = VIS_NONE;
+    unsigned int color[3] = {0, 0, 0};
+
+    for(int y = clip.y0; y < clip.y1; y++){
+        for(int x = clip.x0; x < clip.x1; x++){
+            fb_pixel *p = &zb.fb[fb_index(zb, x, y)];
+            unsigned int i = zb.tri[(y*w) + x];
+            if(i == VIS_NONE){
+                p->r = p->g = p->b = 0;
+                continue;
+            }
+
+            // Set up the triangle when it changes
+            unsigned int sh = zb.shape[(y*w) + x];
+            if((i != cur_tri) || (sh != cur_shape)){
+                cur_tri = i;
+                cur_shape = sh;
+                face &f = pix_triangles[sh][i];
+                if(S::normal) tri_plane_setup(s, f, x, y);
+                else S::tri_color(f, materials[sh], color);
+            }
+
+            if(S::normal){
+                vec4 n = S::persp ? (plane_at(s.nw, s.dnwdx, s.dnwdy, x - s.x0, y - s.y0) / plane_at(s.iw, s.diwdx, s.diwdy, x - s.x0, y - s.y0))
+                                  : plane_at(s.n, s.dndx, s.dndy, x - s.x0, y - s.y0);
+#ifdef NORMALIZE_NORMALS
+                // Interpolated normals are shorter than 1. Rescale them before coloring.
+                n[3] = 0;
+                n.norm();
+#endif
+                get_color(color, n);
+            }
+            p->r = color[0];
+            p->g = color[1];
+            p->b = color[2];
+        }
+    }
+}
+
+/// Pick the specialization of resolve_fill for a shading option (as get_shader). Returns NULL if the option is unknown.
+resolve_fn get_resolver(char *opt);
+
+#endif // SPAN_RASTER_H
@@ -0,0 +1,96 @@
+#include "thread_pool.h"
+#include <assert.h>
+
+///----------------------------------------------------------------------
+/// Constructors
+///----------------------------------------------------------------------
+
+/// Start a pool that runs jobs on n_threads threads in total (including the calling thread)
+thread_pool::thread_pool(int n_threads) : job(NULL), job_ctx(NULL), n_jobs(0), next_job(0), busy(0), batch(0), quit(false){
+    assert(n_threads > 0);
+
+    // The calling thread also runs jobs, so one less worker is needed
+    for(int i = 1; i < n_threads; i++){
+        workers.push_back(std::thread(&thread_pool::work, this));
+    }
+}
+
+/// Stop and join all the workers
+thread_pool::~thread_pool(){
+    {
+        std::unique_lock<std::mutex> l(lock);
+        quit = true;
+    }
+    start_cv.notify_all();
+    for(unsigned int i = 0; i < workers.size(); i++){
+        workers[i].join();
+    }
+}
+
+///----------------------------------------------------------------------
+/// Methods
+///----------------------------------------------------------------------
+
+/// Number of threads (including the calling thread) that run jobs
+int thread_pool::size() const{
+    return workers.size() + 1;
+}
+
+/// Run fn(ctx, 0) ... fn(ctx, count - 1) spread over the threads and wait for all of them to finish
+void thread_pool::run_jobs(int count, void (*fn)(const void *, int), const void *ctx){
+
+    // Nothing to share, run everything on the calling thread
+    if(workers.empty()){
+        for(int i = 0; i < count; i++){
+            fn(ctx, i);
+        }
+        return;
+    }
+
+    // Publish the new batch and wake up the workers
+    {
+        std::unique_lock<std::mutex> l(lock);
+        job = fn;
+        job_ctx = ctx;
+        n_jobs = count;
+        next_job = 0;
+        busy = workers.size();
+        batch++;
+    }
+    start_cv.notify_all();
+
+    // Help out and then wait for the workers to finish their last job
+    drain();
+    std::unique_lock<std::mutex> l(lock);
+    done_cv.wait(l, [this]{ return busy == 0; });
+    job = NULL;
+    job_ctx = NULL;
+}
+
+/// Loop run by every worker thread
+void thread_pool::work(){
+    unsigned long seen = 0;
+    while(true){
+        {
+            std::unique_lock<std::mutex> l(lock);
+            start_cv.wait(l, [this, seen]{ return quit || (batch != seen); });
+            if(quit) return;
+            seen = batch;
+        }
+
+        drain();
+
+        // The last worker to finish wakes up the caller of run()
+        std::unique_lock<std::mutex> l(lock);
+        busy--;
+        if(busy == 0) done_cv.notify_one();
+    }
+}
+
+/// Take job numbers and run them until the batch is empty
+void thread_pool::drain(){
+    int i;
+    while((i = next_job++) < n_jobs){
+        job(job_ctx, i);
+    }
+}
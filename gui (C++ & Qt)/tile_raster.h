@@ -0,0 +1,48 @@
+#ifndef TILE_RASTER_H
+#define TILE_RASTER_H
+
+#include "raster_tools.h"
+#include "thread_pool.h"
+#include "span_raster.h"
+
+/// Width and height of a screen tile in pixels
+#define TILE_SIZE 64
+
+/// Structure to store which triangles overlap each screen tile
+struct tile_bins{
+  int tiles_x; // Number of tiles along the width of the image
+  int tiles_y; // Number of tiles along the height of the image
+  vector< vector< vector<unsigned int> > > ids; // ids[tile][shape] lists the overlapping triangles of the shape in draw order
+  vector<render_stats> stats; // Counters of the rasterizer for each tile, added up once all the tiles are drawn
+  vector<unsigned int> order; // Order in which the shapes are drawn in every tile (shape by shape when empty)
+  const std::atomic<bool> *stop; // When it points to true the tiles not started yet are skipped (NULL to always draw every tile)
+};
+
+/// Sort the triangles of every shape into the screen tiles covered by their bounding boxes.
+/// The lists in bins are reused, so binning a similar scene again does not allocate.
+void bin_triangles(tile_bins &bins, vector< vector<bbox> > &bboxes, int w, int h);
+
+/// Fill the image one tile at a time on the threads of the pool using the shader picked by get_shader.
+/// Each tile is owned by a single thread which writes its pixels and Z-buffer values without locking.
+/// pix_triangles[s] holds the triangles of shape first_shape + s, which are drawn with materials[first_shape + s].
+/// The counters of the rasterizer (hierarchical Z-buffer tests and pixels) are added to stats.
+/// Drawing can be stopped from another thread at tile granularity through bins.stop.
+/// With a depth prepass, depth (a PASS_DEPTH shader) first draws all the shapes of a tile into the Z-buffer and then
+/// shade (the PASS_SHADE shader of the same option) colors each visible pixel once.
+img_t *tile_fill_img(img_t *img, vector< vector<face> > &pix_triangles, vector< vector<bbox> > &bboxes,
+                     vector<tinyobj::material_t> &materials, z_buffer &zb, shade_fn shade, tile_bins &bins, thread_pool &pool,
+                     render_stats &stats, unsigned int first_shape = 0, shade_fn depth = NULL);
+
+/// Shade the whole framebuffer of zb (of the size of img) from its visibility buffer one tile at a time on the threads of the pool.
+/// pix_triangles and materials must be the ones the visibility buffer was drawn with.
+img_t *tile_resolve_img(img_t *img, vector< vector<face> > &pix_triangles, vector<tinyobj::material_t> &materials,
+                        z_buffer &zb, resolve_fn resolve, thread_pool &pool);
+
+/// Copy the colors of the tiled framebuffer of zb to the image one tile at a time on the threads of the pool
+img_t *tile_pack_img(img_t *img, z_buffer &zb, thread_pool &pool);
+void tile_pack_img(img32_t &img, z_buffer &zb, thread_pool &pool);
+
+/// Average the samples of zb into its colors one tile at a time on the threads of the pool (see resolve_samples)
+void tile_resolve_samples(z_buffer &zb, thread_pool &pool);
+
+#endif // TILE_RASTER_H
@@ -31,6 +31,18 @@
 #include <map>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <cstdio>
+#endif
 
 #include "tiny_obj_loader.h"
 
@@ -43,18 +55,100 @@ struct vertex_index {
   vertex_index(int vidx, int vtidx, int vnidx)
       : v_idx(vidx), vt_idx(vtidx), vn_idx(vnidx){};
 };
-// for std::map
-static inline bool operator<(const vertex_index &a, const vertex_index &b) {
-  if (a.v_idx != b.v_idx)
-    return (a.v_idx < b.v_idx);
-  if (a.vn_idx != b.vn_idx)
-    return (a.vn_idx < b.vn_idx);
-  if (a.vt_idx != b.vt_idx)
-    return (a.vt_idx < b.vt_idx);
-
-  return false;
+static inline bool operator==(const vertex_index &a, const vertex_index &b) {
+  return (a.v_idx == b.v_idx) && (a.vt_idx == b.vt_idx) &&
+         (a.vn_idx == b.vn_idx);
 }
 
+// Open addressing hash table mapping the (v, vt, vn) triples of a face group
+// to the index of their vertex in the shape.
+// The slots only hold the position of the triple in 'keys', and 'keys' is
+// filled in the same order as the vertices are added to the shape, so the
+// vertex index is simply base + position.
+// Slots are marked as used with the current stamp, so emptying the table
+// between face groups only increments the stamp and keeps the memory.
+class vertex_cache {
+public:
+  vertex_cache() : mask(0), stamp(0), base(0) {}
+
+  // Empty the table for a face group with about n distinct triples whose
+  // new vertices are numbered from base.
+  void clear(size_t n, unsigned int first) {
+    keys.clear();
+    keys.reserve(n);
+    base = first;
+    if (slots.size() < 2 * n || slots.empty()) {
+      resize(2 * n);
+    } else if (++stamp == 0) {
+      std::fill(slots.begin(), slots.end(), slot());
+      stamp = 1;
+    }
+  }
+
+  // Index of the vertex of triple i. If i is new, it gets the next index
+  // and 'added' is set to true.
+  unsigned int insert(const vertex_index &i, bool &added) {
+    size_t h = hash(i) & mask;
+    while (slots[h].stamp == stamp) {
+      if (keys[slots[h].key] == i) {
+        added = false;
+        return base + slots[h].key;
+      }
+      h = (h + 1) & mask;
+    }
+
+    added = true;
+    unsigned int key = static_cast<unsigned int>(keys.size());
+    slots[h].stamp = stamp;
+    slots[h].key = key;
+    keys.push_back(i);
+
+    // Keep the table at most half full
+    if (2 * keys.size() > slots.size())
+      resize(2 * slots.size());
+    return base + key;
+  }
+
+private:
+  struct slot {
+    unsigned int stamp; // Used if equal to the stamp of the table
+    unsigned int key;   // Position of the triple in keys
+    slot() : stamp(0), key(0) {}
+  };
+
+  std::vector<slot> slots;
+  std::vector<vertex_index> keys; // Triples in the order they were added
+  size_t mask;
+  unsigned int stamp;
+  unsigned int base;
+
+  // Mix the packed triple
+  static inline size_t hash(const vertex_index &i) {
+    unsigned long long h =
+        static_cast<unsigned int>(i.v_idx) * 0x9E3779B97F4A7C15ULL ^
+        static_cast<unsigned int>(i.vt_idx) * 0xC2B2AE3D27D4EB4FULL ^
+        static_cast<unsigned int>(i.vn_idx) * 0x165667B19E3779F9ULL;
+    return static_cast<size_t>(h ^ (h >> 29));
+  }
+
+  // Grow to at least n slots (a power of two) and put the keys back in.
+  void resize(size_t n) {
+    size_t size = 16;
+    while (size < n)
+      size *= 2;
+    slots.assign(size, slot());
+    mask = size - 1;
+    stamp = 1;
+    for (unsigned int k = 0; k < keys.size(); k++) {
+      size_t h = hash(keys[k]) & mask;
+      while (slots[h].stamp == stamp)
+        h = (h + 1) & mask;
+      slots[h].stamp = stamp;
+      slots[h].key = k;
+    }
+  }
+};
+
 struct obj_shape {
   std::vector<float> v;
   std::vector<float> vn;
@@ -296,17 +390,18 @@ static vertex_index parseTriple(const char *&token, int vsize, int vnsize,
 }
 
 static unsigned int
-updateVertex(std::map<vertex_index, unsigned int> &vertexCache,
+updateVertex(vertex_cache &vertexCache,
              std::vector<float> &positions, std::vector<float> &normals,
              std::vector<float> &texcoords,
              const std::vector<float> &in_positions,
              const std::vector<float> &in_normals,
              const std::vector<float> &in_texcoords, const vertex_index &i) {
-  const std::map<vertex_index, unsigned int>::iterator it = vertexCache.find(i);
+  bool added;
+  unsigned int idx = vertexCache.insert(i, added);
 
-  if (it != vertexCache.end()) {
+  if (!added) {
     // found cache
-    return it->second;
+    return idx;
   }
 
   assert(in_positions.size() > (unsigned int)(3 * i.v_idx + 2));
@@ -326,8 +421,7 @@ updateVertex(std::map<vertex_index, unsigned int> &vertexCache,
     texcoords.push_back(in_texcoords[2 * i.vt_idx + 1]);
   }
 
-  unsigned int idx = static_cast<unsigned int>(positions.size() / 3 - 1);
-  vertexCache[i] = idx;
+  assert(idx == positions.size() / 3 - 1);
 
   return idx;
 }
@@ -353,16 +447,25 @@ void InitMaterial(material_t &material) {
 }
 
 static bool exportFaceGroupToShape(
-    shape_t &shape, std::map<vertex_index, unsigned int> vertexCache,
+    shape_t &shape, vertex_cache &vertexCache,
     const std::vector<float> &in_positions,
     const std::vector<float> &in_normals,
     const std::vector<float> &in_texcoords,
     const std::vector<std::vector<vertex_index> > &faceGroup,
-    const int material_id, const std::string &name, bool clearCache) {
+    const int material_id, const std::string &name) {
   if (faceGroup.empty()) {
     return false;
   }
 
+  // Size the vertex cache for the face group. There are no more distinct
+  // vertices than corners, and usually about as many as positions.
+  size_t corners = 0;
+  for (size_t i = 0; i < faceGroup.size(); i++) {
+    corners += faceGroup[i].size();
+  }
+  vertexCache.clear(std::min(corners, in_positions.size() / 3),
+                    static_cast<unsigned int>(shape.mesh.positions.size() / 3));
+
   // Flatten vertices and indices
   for (size_t i = 0; i < faceGroup.size(); i++) {
     const std::vector<vertex_index> &face = faceGroup[i];
@@ -398,9 +501,6 @@ static bool exportFaceGroupToShape(
 
   shape.name = name;
 
-  if (clearCache)
-    vertexCache.clear();
-
   return true;
 }
 
@@ -656,7 +756,7 @@ std::string LoadObj(std::vector<shape_t> &shapes,
 
   // material
   std::map<std::string, int> material_map;
-  std::map<vertex_index, unsigned int> vertexCache;
+  vertex_cache vertexCache;
   int material = -1;
 
   shape_t shape;
@@ -758,7 +858,7 @@ std::string LoadObj(std::vector<shape_t> &shapes,
 
       // Create face group per material.
       bool ret = exportFaceGroupToShape(shape, vertexCache, v, vn, vt,
-                                        faceGroup, material, name, true);
+                                        faceGroup, material, name);
       if (ret) {
         faceGroup.clear();
       }
@@ -797,9 +897,11 @@ std::string LoadObj(std::vector<shape_t> &shapes,
 
       // flush previous face group.
       bool ret = exportFaceGroupToShape(shape, vertexCache, v, vn, vt,
-                                        faceGroup, material, name, true);
+                                        faceGroup, material, name);
       if (ret) {
-        shapes.push_back(shape);
+        // Move the shape instead of copying its mesh
+        shapes.push_back(shape_t());
+        std::swap(shapes.back(), shape);
       }
 
       shape = shape_t();
@@ -831,9 +933,11 @@ std::string LoadObj(std::vector<shape_t> &shapes,
 
       // flush previous face group.
       bool ret = exportFaceGroupToShape(shape, vertexCache, v, vn, vt,
-                                        faceGroup, material, name, true);
+                                        faceGroup, material, name);
       if (ret) {
-        shapes.push_back(shape);
+        // Move the shape instead of copying its mesh
+        shapes.push_back(shape_t());
+        std::swap(shapes.back(), shape);
       }
 
       // material = -1;
@@ -857,12 +961,726 @@ std::string LoadObj(std::vector<shape_t> &shapes,
   }
 
   bool ret = exportFaceGroupToShape(shape, vertexCache, v, vn, vt, faceGroup,
-                                    material, name, true);
+                                    material, name);
   if (ret) {
-    shapes.push_back(shape);
+    shapes.push_back(shape_t());
+    std::swap(shapes.back(), shape);
   }
   faceGroup.clear(); // for safety
 
   return err.str();
 }
+
+//
+// Multi-threaded loader.
+//
+// The file is mapped into memory and cut into chunks at line boundaries.
+// A first pass counts the v/vn/vt lines of every chunk, so that each chunk
+// knows how many vertices come before it. This is all that is needed to
+// resolve relative (negative) indices the same way as the sequential loader.
+// A second pass parses the chunks in parallel: vertex data goes straight to
+// its final place and faces are kept in a flat list next to the other
+// commands (usemtl, mtllib, g, o). The commands are then replayed in file
+// order to cut the faces into face groups, and the face groups are turned
+// into shapes in parallel.
+//
+
+// Minimum size of a chunk of the file
+#define TINYOBJ_MIN_CHUNK (1 << 20)
+
+// Number of chunks per thread (to balance the load between threads)
+#define TINYOBJ_CHUNKS_PER_THREAD 4
+
+enum obj_command_type { OBJ_USEMTL, OBJ_MTLLIB, OBJ_GROUP, OBJ_OBJECT };
+
+// A command other than v, vn, vt and f, in the order it appears in a chunk.
+struct obj_command {
+  obj_command_type type;
+  std::string name;
+  size_t face; // Number of faces of the chunk before the command
+};
+
+// A part of the file parsed by one thread.
+struct obj_chunk {
+  const char *begin, *end;
+  size_t v, vn, vt;                   // Number of v, vn and vt lines
+  size_t v_first, vn_first, vt_first; // Number of v, vn and vt lines before
+  std::vector<vertex_index> corners;  // Corners of all the faces
+  std::vector<size_t> face_end;       // End of each face in corners
+  std::vector<obj_command> commands;
+};
+
+// Faces [first, last) of a chunk
+struct obj_face_range {
+  const obj_chunk *chunk;
+  size_t first, last;
+};
+
+// Faces sharing a material, possibly spread over several chunks.
+struct obj_face_group {
+  std::vector<obj_face_range> ranges;
+  int material_id;
+  size_t shape;
+  mesh_t mesh; // Vertices and triangles of the group
+};
+
+// Call job(0, thread) ... job(count - 1, thread) spread over num_threads
+// threads, where thread is the number of the thread running the job.
+template <class F>
+static void parallelFor(int count, int num_threads, const F &job) {
+  std::atomic<int> next(0);
+  auto worker = [&](int thread) {
+    for (int i = next++; i < count; i = next++)
+      job(i, thread);
+  };
+  std::vector<std::thread> threads;
+  for (int t = 1; t < std::min(num_threads, count); t++)
+    threads.push_back(std::thread(worker, t));
+  worker(0);
+  for (size_t t = 0; t < threads.size(); t++)
+    threads[t].join();
+}
+
+// Map a whole file into memory (data is NULL for an empty file).
+static bool mapFile(const char *filename, char *&data, size_t &size) {
+  struct stat st;
+  data = NULL;
+  size = 0;
+  if (stat(filename, &st) != 0)
+    return false;
+  if (st.st_size == 0)
+    return true;
+#ifndef _WIN32
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return false;
+  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return false;
+  data = static_cast<char *>(p);
+#else
+  // No mmap here. Read the file into memory instead.
+  data = static_cast<char *>(malloc(st.st_size));
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL ||
+      fread(data, 1, st.st_size, f) != static_cast<size_t>(st.st_size)) {
+    if (f != NULL)
+      fclose(f);
+    free(data);
+    data = NULL;
+    return false;
+  }
+  fclose(f);
+#endif
+  size = static_cast<size_t>(st.st_size);
+  return true;
+}
+
+// Release a file mapped with mapFile.
+static void unmapFile(char *data, size_t size) {
+  if (data == NULL)
+    return;
+#ifndef _WIN32
+  munmap(data, size);
+#else
+  free(data);
+#endif
+}
+
+// Copy the line starting at p to line (without the newline) and move p to
+// the next line. Returns the first token, or NULL for empty and comment
+// lines.
+static const char *nextLine(const char *&p, const char *end,
+                            std::vector<char> &line) {
+  const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+  if (eol == NULL)
+    eol = end;
+  size_t n = eol - p;
+
+  // Trim '\r\n'
+  if (n > 0 && p[n - 1] == '\r')
+    n--;
+  line.resize(n + 1);
+  memcpy(&line[0], p, n);
+  line[n] = '\0';
+  p = (eol < end) ? eol + 1 : end;
+
+  // Skip leading space.
+  const char *token = &line[0];
+  token += strspn(token, " \t");
+  if (token[0] == '\0' || token[0] == '#')
+    return NULL;
+  return token;
+}
+
+// Count the v, vn and vt lines of a chunk.
+static void countChunk(obj_chunk &chunk) {
+  chunk.v = chunk.vn = chunk.vt = 0;
+  std::vector<char> line;
+  const char *p = chunk.begin;
+  while (p < chunk.end) {
+    const char *token = nextLine(p, chunk.end, line);
+    if (token == NULL || token[0] != 'v')
+      continue;
+    if (isSpace(token[1]))
+      chunk.v++;
+    else if (token[1] == 'n' && isSpace(token[2]))
+      chunk.vn++;
+    else if (token[1] == 't' && isSpace(token[2]))
+      chunk.vt++;
+  }
+}
+
+// Read the name after a command like the sequential loader does.
+static std::string scanName(const char *token) {
+  char namebuf[4096];
+  namebuf[0] = '\0';
+#ifdef _MSC_VER
+  sscanf_s(token, "%s", namebuf);
+#else
+  sscanf(token, "%s", namebuf);
+#endif
+  return std::string(namebuf);
+}
+
+// Parse a chunk. The vertex data is written to v, vn and vt after the
+// vertices of the previous chunks.
+static void parseChunk(obj_chunk &chunk, std::vector<float> &v,
+                       std::vector<float> &vn, std::vector<float> &vt) {
+  size_t nv = chunk.v_first, nvn = chunk.vn_first, nvt = chunk.vt_first;
+  std::vector<char> line;
+  const char *p = chunk.begin;
+  while (p < chunk.end) {
+    const char *token = nextLine(p, chunk.end, line);
+    if (token == NULL)
+      continue;
+
+    // vertex
+    if (token[0] == 'v' && isSpace((token[1]))) {
+      token += 2;
+      parseFloat3(v[3 * nv + 0], v[3 * nv + 1], v[3 * nv + 2], token);
+      nv++;
+      continue;
+    }
+
+    // normal
+    if (token[0] == 'v' && token[1] == 'n' && isSpace((token[2]))) {
+      token += 3;
+      parseFloat3(vn[3 * nvn + 0], vn[3 * nvn + 1], vn[3 * nvn + 2], token);
+      nvn++;
+      continue;
+    }
+
+    // texcoord
+    if (token[0] == 'v' && token[1] == 't' && isSpace((token[2]))) {
+      token += 3;
+      parseFloat2(vt[2 * nvt + 0], vt[2 * nvt + 1], token);
+      nvt++;
+      continue;
+    }
+
+    // face
+    if (token[0] == 'f' && isSpace((token[1]))) {
+      token += 2;
+      token += strspn(token, " \t");
+
+      while (!isNewLine(token[0])) {
+        vertex_index vi =
+            parseTriple(token, static_cast<int>(nv), static_cast<int>(nvn),
+                        static_cast<int>(nvt));
+        chunk.corners.push_back(vi);
+        size_t n = strspn(token, " \t\r");
+        token += n;
+      }
+      chunk.face_end.push_back(chunk.corners.size());
+      continue;
+    }
+
+    obj_command cmd;
+    cmd.face = chunk.face_end.size();
+
+    // use mtl
+    if ((0 == strncmp(token, "usemtl", 6)) && isSpace((token[6]))) {
+      cmd.type = OBJ_USEMTL;
+      cmd.name = scanName(token + 7);
+      chunk.commands.push_back(cmd);
+      continue;
+    }
+
+    // load mtl
+    if ((0 == strncmp(token, "mtllib", 6)) && isSpace((token[6]))) {
+      cmd.type = OBJ_MTLLIB;
+      cmd.name = scanName(token + 7);
+      chunk.commands.push_back(cmd);
+      continue;
+    }
+
+    // group name
+    if (token[0] == 'g' && isSpace((token[1]))) {
+      // names[0] must be 'g', so skip it.
+      parseString(token);
+      token += strspn(token, " \t\r");
+      cmd.type = OBJ_GROUP;
+      if (!isNewLine(token[0]))
+        cmd.name = parseString(token);
+      chunk.commands.push_back(cmd);
+      continue;
+    }
+
+    // object name
+    if (token[0] == 'o' && isSpace((token[1]))) {
+      cmd.type = OBJ_OBJECT;
+      cmd.name = scanName(token + 2);
+      chunk.commands.push_back(cmd);
+      continue;
+    }
+
+    // Ignore unknown command.
+  }
+}
+
+// Triangulate a face group into its own mesh (the vertex cache starts empty
+// for every group, as in the sequential loader).
+static void exportFaceGroupToMesh(obj_face_group &group,
+                                  vertex_cache &vertexCache,
+                                  const std::vector<float> &in_positions,
+                                  const std::vector<float> &in_normals,
+                                  const std::vector<float> &in_texcoords) {
+  mesh_t &mesh = group.mesh;
+
+  size_t corners = 0;
+  for (size_t r = 0; r < group.ranges.size(); r++) {
+    const obj_chunk &chunk = *group.ranges[r].chunk;
+    size_t first = group.ranges[r].first;
+    corners += chunk.face_end[group.ranges[r].last - 1] -
+               ((first > 0) ? chunk.face_end[first - 1] : 0);
+  }
+  vertexCache.clear(std::min(corners, in_positions.size() / 3), 0);
+
+  for (size_t r = 0; r < group.ranges.size(); r++) {
+    const obj_chunk &chunk = *group.ranges[r].chunk;
+    for (size_t f = group.ranges[r].first; f < group.ranges[r].last; f++) {
+      size_t first = (f > 0) ? chunk.face_end[f - 1] : 0;
+      size_t npolys = chunk.face_end[f] - first;
+      if (npolys < 3)
+        continue;
+      const vertex_index *face = &chunk.corners[first];
+
+      // Polygon -> triangle fan conversion
+      for (size_t k = 2; k < npolys; k++) {
+        unsigned int v0 = updateVertex(
+            vertexCache, mesh.positions, mesh.normals, mesh.texcoords,
+            in_positions, in_normals, in_texcoords, face[0]);
+        unsigned int v1 = updateVertex(
+            vertexCache, mesh.positions, mesh.normals, mesh.texcoords,
+            in_positions, in_normals, in_texcoords, face[k - 1]);
+        unsigned int v2 = updateVertex(
+            vertexCache, mesh.positions, mesh.normals, mesh.texcoords,
+            in_positions, in_normals, in_texcoords, face[k]);
+
+        mesh.indices.push_back(v0);
+        mesh.indices.push_back(v1);
+        mesh.indices.push_back(v2);
+
+        mesh.material_ids.push_back(group.material_id);
+      }
+    }
+  }
+}
+
+// Append the mesh of a face group to the mesh of its shape.
+static void appendMesh(mesh_t &mesh, mesh_t &group_mesh) {
+  if (mesh.positions.empty()) {
+    std::swap(mesh, group_mesh);
+    return;
+  }
+  unsigned int offset = static_cast<unsigned int>(mesh.positions.size() / 3);
+  mesh.positions.insert(mesh.positions.end(), group_mesh.positions.begin(),
+                        group_mesh.positions.end());
+  mesh.normals.insert(mesh.normals.end(), group_mesh.normals.begin(),
+                      group_mesh.normals.end());
+  mesh.texcoords.insert(mesh.texcoords.end(), group_mesh.texcoords.begin(),
+                        group_mesh.texcoords.end());
+  for (size_t i = 0; i < group_mesh.indices.size(); i++)
+    mesh.indices.push_back(group_mesh.indices[i] + offset);
+  mesh.material_ids.insert(mesh.material_ids.end(),
+                           group_mesh.material_ids.begin(),
+                           group_mesh.material_ids.end());
+  group_mesh = mesh_t();
+}
+
+std::string LoadObj(std::vector<shape_t> &shapes,
+                    std::vector<material_t> &materials, // [output]
+                    const char *filename, const char *mtl_basepath,
+                    int num_threads) {
+
+  shapes.clear();
+
+  std::stringstream err;
+
+  if (num_threads < 1)
+    num_threads = 1;
+
+  // Map the whole file
+  char *data;
+  size_t size;
+  if (!mapFile(filename, data, size)) {
+    err << "Cannot open file [" << filename << "]" << std::endl;
+    return err.str();
+  }
+
+  // Cut the file into chunks at line boundaries
+  size_t n_chunks = std::min(static_cast<size_t>(num_threads) *
+                                 TINYOBJ_CHUNKS_PER_THREAD,
+                             size / TINYOBJ_MIN_CHUNK);
+  if (n_chunks < 1)
+    n_chunks = 1;
+  std::vector<obj_chunk> chunks(n_chunks);
+  const char *end = data + size;
+  const char *p = data;
+  for (size_t c = 0; c < n_chunks; c++) {
+    chunks[c].begin = p;
+    const char *cut = data + size * (c + 1) / n_chunks;
+    if (c + 1 == n_chunks) {
+      p = end;
+    } else if (p < cut) {
+      const char *eol = static_cast<const char *>(memchr(cut, '\n', end - cut));
+      p = (eol != NULL) ? eol + 1 : end;
+    }
+    chunks[c].end = p;
+  }
+
+  // Count the vertices of every chunk and size the vertex arrays
+  parallelFor(static_cast<int>(n_chunks), num_threads,
+              [&](int c, int) { countChunk(chunks[c]); });
+  size_t nv = 0, nvn = 0, nvt = 0;
+  for (size_t c = 0; c < n_chunks; c++) {
+    chunks[c].v_first = nv;
+    chunks[c].vn_first = nvn;
+    chunks[c].vt_first = nvt;
+    nv += chunks[c].v;
+    nvn += chunks[c].vn;
+    nvt += chunks[c].vt;
+  }
+  std::vector<float> v(3 * nv), vn(3 * nvn), vt(2 * nvt);
+
+  // Parse the chunks
+  parallelFor(static_cast<int>(n_chunks), num_threads,
+              [&](int c, int) { parseChunk(chunks[c], v, vn, vt); });
+
+  unmapFile(data, size);
+
+  // Replay the commands in file order to cut the faces into face groups.
+  // A face group is closed by usemtl, g and o (and the end of the file).
+  // g and o also close the shape, which is kept only if its last face group
+  // is not empty.
+  std::string basePath;
+  if (mtl_basepath) {
+    basePath = mtl_basepath;
+  }
+  MaterialFileReader readMatFn(basePath);
+  std::map<std::string, int> material_map;
+  int material = -1;
+  std::string name;
+  std::vector<std::string> names; // Names of the shapes kept so far
+  std::vector<obj_face_group> groups;
+  obj_face_group faceGroup;
+
+  for (size_t c = 0; c < n_chunks && err.str().empty(); c++) {
+    const obj_chunk &chunk = chunks[c];
+    size_t first = 0;
+    for (size_t i = 0; i <= chunk.commands.size(); i++) {
+      bool last = (i == chunk.commands.size());
+      size_t face = last ? chunk.face_end.size() : chunk.commands[i].face;
+      if (face > first) {
+        obj_face_range range = {&chunk, first, face};
+        faceGroup.ranges.push_back(range);
+      }
+      first = face;
+      if (last)
+        break;
+
+      const obj_command &cmd = chunk.commands[i];
+      if (cmd.type == OBJ_MTLLIB) {
+        std::string err_mtl = readMatFn(cmd.name, materials, material_map);
+        if (!err_mtl.empty()) {
+          err << err_mtl;
+          break;
+        }
+        continue;
+      }
+
+      // Flush the face group
+      bool ret = !faceGroup.ranges.empty();
+      if (ret) {
+        faceGroup.material_id = material;
+        faceGroup.shape = names.size();
+        groups.push_back(faceGroup);
+        faceGroup = obj_face_group();
+      }
+
+      if (cmd.type == OBJ_USEMTL) {
+        if (material_map.find(cmd.name) != material_map.end()) {
+          material = material_map[cmd.name];
+        } else {
+          // { error!! material not found }
+          material = -1;
+        }
+        continue;
+      }
+
+      // g or o: flush the shape
+      if (ret) {
+        names.push_back(name);
+      }
+      while (!groups.empty() && groups.back().shape == names.size())
+        groups.pop_back();
+      name = cmd.name;
+    }
+  }
+
+  if (err.str().empty() && !faceGroup.ranges.empty()) {
+    faceGroup.material_id = material;
+    faceGroup.shape = names.size();
+    groups.push_back(faceGroup);
+    names.push_back(name);
+  }
+  while (!groups.empty() && groups.back().shape == names.size())
+    groups.pop_back();
+
+  // Triangulate the face groups. Every thread reuses its own vertex cache.
+  std::vector<vertex_cache> caches(num_threads);
+  parallelFor(static_cast<int>(groups.size()), num_threads,
+              [&](int g, int thread) {
+                exportFaceGroupToMesh(groups[g], caches[thread], v, vn, vt);
+              });
+
+  // Join the face groups of every shape
+  std::vector<size_t> shape_groups(names.size() + 1, 0);
+  for (size_t g = 0; g < groups.size(); g++)
+    shape_groups[groups[g].shape + 1] = g + 1;
+  for (size_t s = 1; s < shape_groups.size(); s++)
+    shape_groups[s] = std::max(shape_groups[s], shape_groups[s - 1]);
+  shapes.resize(names.size());
+  parallelFor(static_cast<int>(names.size()), num_threads, [&](int s, int) {
+    shapes[s].name = names[s];
+    for (size_t g = shape_groups[s]; g < shape_groups[s + 1]; g++)
+      appendMesh(shapes[s].mesh, groups[g].mesh);
+  });
+
+  return err.str();
+}
+
+//
+// Batched loader.
+//
+// The file is read once from start to end and its faces are handed over in
+// batches as soon as enough of them have been read, so only the vertex data
+// of the file is ever kept. The faces of a batch all belong to the same
+// shape and use the same material.
+//
+
+// Faces read but not handed over yet
+struct obj_batch {
+  std::vector<vertex_index> corners;
+  std::vector<size_t> face_end;
+  size_t triangles;
+  obj_batch() : triangles(0) {}
+};
+
+// Triangulate the pending faces into 'shape' and hand them over.
+static void flushBatch(obj_batch &batch, shape_t &shape, int shape_id,
+                       int material_id, vertex_cache &vertexCache,
+                       const std::vector<float> &v,
+                       const std::vector<float> &vn,
+                       const std::vector<float> &vt,
+                       ShapeBatchCallback &callback) {
+  if (batch.face_end.empty())
+    return;
+
+  mesh_t &mesh = shape.mesh;
+  mesh.positions.clear();
+  mesh.normals.clear();
+  mesh.texcoords.clear();
+  mesh.indices.clear();
+  mesh.material_ids.clear();
+  vertexCache.clear(std::min(batch.corners.size(), v.size() / 3), 0);
+
+  for (size_t f = 0; f < batch.face_end.size(); f++) {
+    size_t first = (f > 0) ? batch.face_end[f - 1] : 0;
+    size_t npolys = batch.face_end[f] - first;
+    const vertex_index *face = &batch.corners[first];
+
+    // Polygon -> triangle fan conversion
+    for (size_t k = 2; k < npolys; k++) {
+      mesh.indices.push_back(updateVertex(vertexCache, mesh.positions,
+                                          mesh.normals, mesh.texcoords, v,
+                                          vn, vt, face[0]));
+      mesh.indices.push_back(updateVertex(vertexCache, mesh.positions,
+                                          mesh.normals, mesh.texcoords, v,
+                                          vn, vt, face[k - 1]));
+      mesh.indices.push_back(updateVertex(vertexCache, mesh.positions,
+                                          mesh.normals, mesh.texcoords, v,
+                                          vn, vt, face[k]));
+      mesh.material_ids.push_back(material_id);
+    }
+  }
+
+  batch.corners.clear();
+  batch.face_end.clear();
+  batch.triangles = 0;
+
+  callback(shape, shape_id);
+}
+
+std::string LoadObjBatches(std::vector<material_t> &materials, // [output]
+                           const char *filename, const char *mtl_basepath,
+                           size_t max_triangles,
+                           ShapeBatchCallback &callback) {
+  std::stringstream err;
+
+  char *data;
+  size_t size;
+  if (!mapFile(filename, data, size)) {
+    err << "Cannot open file [" << filename << "]" << std::endl;
+    return err.str();
+  }
+  if (max_triangles < 1)
+    max_triangles = 1;
+
+  std::string basePath;
+  if (mtl_basepath) {
+    basePath = mtl_basepath;
+  }
+  MaterialFileReader readMatFn(basePath);
+  std::map<std::string, int> material_map;
+
+  std::vector<float> v, vn, vt;
+  obj_batch batch;
+  vertex_cache vertexCache;
+  shape_t shape;
+  int shape_id = 0;
+  bool shape_used = false; // A face was read since the shape started
+  int material = -1;
+
+  std::vector<char> line;
+  const char *p = data;
+  const char *end = data + size;
+  while (p < end) {
+    const char *token = nextLine(p, end, line);
+    if (token == NULL)
+      continue;
+
+    // vertex
+    if (token[0] == 'v' && isSpace((token[1]))) {
+      token += 2;
+      float x, y, z;
+      parseFloat3(x, y, z, token);
+      v.push_back(x);
+      v.push_back(y);
+      v.push_back(z);
+      continue;
+    }
+
+    // normal
+    if (token[0] == 'v' && token[1] == 'n' && isSpace((token[2]))) {
+      token += 3;
+      float x, y, z;
+      parseFloat3(x, y, z, token);
+      vn.push_back(x);
+      vn.push_back(y);
+      vn.push_back(z);
+      continue;
+    }
+
+    // texcoord
+    if (token[0] == 'v' && token[1] == 't' && isSpace((token[2]))) {
+      token += 3;
+      float x, y;
+      parseFloat2(x, y, token);
+      vt.push_back(x);
+      vt.push_back(y);
+      continue;
+    }
+
+    // face
+    if (token[0] == 'f' && isSpace((token[1]))) {
+      token += 2;
+      token += strspn(token, " \t");
+
+      size_t first = batch.corners.size();
+      while (!isNewLine(token[0])) {
+        vertex_index vi = parseTriple(token, static_cast<int>(v.size() / 3),
+                                      static_cast<int>(vn.size() / 3),
+                                      static_cast<int>(vt.size() / 2));
+        batch.corners.push_back(vi);
+        size_t n = strspn(token, " \t\r");
+        token += n;
+      }
+      batch.face_end.push_back(batch.corners.size());
+      size_t npolys = batch.corners.size() - first;
+      if (npolys > 2)
+        batch.triangles += npolys - 2;
+      shape_used = true;
+
+      if (batch.triangles >= max_triangles)
+        flushBatch(batch, shape, shape_id, material, vertexCache, v, vn, vt,
+                   callback);
+      continue;
+    }
+
+    // use mtl
+    if ((0 == strncmp(token, "usemtl", 6)) && isSpace((token[6]))) {
+      flushBatch(batch, shape, shape_id, material, vertexCache, v, vn, vt,
+                 callback);
+      std::string name = scanName(token + 7);
+      if (material_map.find(name) != material_map.end()) {
+        material = material_map[name];
+      } else {
+        // { error!! material not found }
+        material = -1;
+      }
+      continue;
+    }
+
+    // load mtl
+    if ((0 == strncmp(token, "mtllib", 6)) && isSpace((token[6]))) {
+      std::string err_mtl =
+          readMatFn(scanName(token + 7), materials, material_map);
+      if (!err_mtl.empty()) {
+        unmapFile(data, size);
+        return err_mtl;
+      }
+      continue;
+    }
+
+    // group name or object name
+    if ((token[0] == 'g' || token[0] == 'o') && isSpace((token[1]))) {
+      flushBatch(batch, shape, shape_id, material, vertexCache, v, vn, vt,
+                 callback);
+      if (shape_used)
+        shape_id++;
+      shape_used = false;
+
+      if (token[0] == 'g') {
+        // names[0] must be 'g', so skip it.
+        parseString(token);
+        token += strspn(token, " \t\r");
+        shape.name = isNewLine(token[0]) ? "" : parseString(token);
+      } else {
+        shape.name = scanName(token + 2);
+      }
+      continue;
+    }
+
+    // Ignore unknown command.
+  }
+
+  flushBatch(batch, shape, shape_id, material, vertexCache, v, vn, vt,
+             callback);
+  unmapFile(data, size);
+
+  return err.str();
+}
 }
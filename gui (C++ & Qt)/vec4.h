@@ -1,11 +1,29 @@
 #ifndef VEC4_H
 #define VEC4_H
+
 #include <iostream>
 
+// vec4 and mat4 use SSE (and AVX for the matrix product when compiled with -mavx).
+// Define VEC4_SCALAR to build the plain element-wise loops instead, e.g. to compare results.
+// Targets without SSE2 (other architectures, or 32-bit x86 built without it) always use the plain loops.
+#if !defined(VEC4_SCALAR) && !defined(__SSE2__) && !defined(_M_X64) && !(defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define VEC4_SCALAR
+#endif
+#ifndef VEC4_SCALAR
+#include <xmmintrin.h>
+#endif
+
 class vec4 {
 private:
     ///The set of floats representing the coordinates of the vector
-    float data[4];
+    ///Aligned to 16 bytes so that the SIMD code can load and store it with a single instruction
+    alignas(16) float data[4];
+
+    /// The free functions and the matrix class work on the raw data
+    friend float dot(const vec4 &v1, const vec4 &v2);
+    friend vec4 cross(const vec4 &v1, const vec4 &v2);
+    friend vec4 operator*(float c, const vec4 &v);
+    friend class mat4;
 public:
     ///----------------------------------------------------------------------
     /// Constructors
@@ -0,0 +1,215 @@
+#include "vertex_stage.h"
+
+// The batches use 8 wide AVX registers when available, or two 4 wide SSE registers otherwise.
+// The vf_* wrappers keep the code the same for both.
+#if !defined(VEC4_SCALAR) && defined(__AVX__)
+#include <immintrin.h>
+typedef __m256 vf;
+#define VF_WIDTH 8
+#define vf_load(p) _mm256_loadu_ps(p)
+#define vf_store(p, a) _mm256_storeu_ps(p, a)
+#define vf_set1(c) _mm256_set1_ps(c)
+#define vf_add(a, b) _mm256_add_ps(a, b)
+#define vf_sub(a, b) _mm256_sub_ps(a, b)
+#define vf_mul(a, b) _mm256_mul_ps(a, b)
+#define vf_div(a, b) _mm256_div_ps(a, b)
+#define vf_or(a, b) _mm256_or_ps(a, b)
+#define vf_cmplt(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define vf_movemask(a) _mm256_movemask_ps(a)
+#elif !defined(VEC4_SCALAR)
+#include <xmmintrin.h>
+typedef __m128 vf;
+#define VF_WIDTH 4
+#define vf_load(p) _mm_loadu_ps(p)
+#define vf_store(p, a) _mm_storeu_ps(p, a)
+#define vf_set1(c) _mm_set1_ps(c)
+#define vf_add(a, b) _mm_add_ps(a, b)
+#define vf_sub(a, b) _mm_sub_ps(a, b)
+#define vf_mul(a, b) _mm_mul_ps(a, b)
+#define vf_div(a, b) _mm_div_ps(a, b)
+#define vf_or(a, b) _mm_or_ps(a, b)
+#define vf_cmplt(a, b) _mm_cmplt_ps(a, b)
+#define vf_movemask(a) _mm_movemask_ps(a)
+#endif
+
+// Transform a single vertex. Used for the vertices left over after the last full batch (and for every vertex in the scalar build).
+// The sums are done in the same order as mat4 * vec4.
+static void transform_one(const float *pos, const float *norm, cam_dat &cam, float w, float h, vert_soa &out, size_t k){
+
+    const mat4 &m = cam.per_mat;
+    float x = ((m[0][0] * pos[0]) + (m[1][0] * pos[1]) + (m[2][0] * pos[2])) + m[3][0];
+    float y = ((m[0][1] * pos[0]) + (m[1][1] * pos[1]) + (m[2][1] * pos[2])) + m[3][1];
+    float z = ((m[0][2] * pos[0]) + (m[1][2] * pos[1]) + (m[2][2] * pos[2])) + m[3][2];
+    float hw = ((m[0][3] * pos[0]) + (m[1][3] * pos[1]) + (m[2][3] * pos[2])) + m[3][3];
+
+    // Classify against the frustum planes before the division
+    out.clip[k] = clip_code(x, y, z, hw);
+
+    // Keep 1/w for perspective corrected interpolation, convert to NDC and then to pixel coordinates
+    out.iw[k] = 1.0f / hw;
+    out.x[k] = ((x / hw) + 1) * w * 0.5f;
+    out.y[k] = (1 - (y / hw)) * h * 0.5f;
+    out.z[k] = z / hw;
+
+    // Rotate the normals to the camera frame
+    if(norm){
+        const mat4 &r = cam.rot_mat;
+        out.nx[k] = ((r[0][0] * norm[0]) + (r[1][0] * norm[1]) + (r[2][0] * norm[2])) + r[3][0];
+        out.ny[k] = ((r[0][1] * norm[0]) + (r[1][1] * norm[1]) + (r[2][1] * norm[2])) + r[3][1];
+        out.nz[k] = ((r[0][2] * norm[0]) + (r[1][2] * norm[1]) + (r[2][2] * norm[2])) + r[3][2];
+    }
+    else{
+        out.nx[k] = out.ny[k] = out.nz[k] = 0;
+    }
+}
+
+// Transform n vertices into out starting at vertex first
+void transform_verts(const float *pos, const float *norm, size_t n, cam_dat &cam, int w, int h,
+                     vert_soa &out, size_t first){
+
+    size_t i = 0;
+
+#ifndef VEC4_SCALAR
+    // Broadcast the matrix entries once
+    vf m[4][4], r[4][4];
+    for(int c = 0; c < 4; c++){
+        for(int j = 0; j < 4; j++){
+            m[c][j] = vf_set1(cam.per_mat[c][j]);
+            r[c][j] = vf_set1(cam.rot_mat[c][j]);
+        }
+    }
+    vf one = vf_set1(1);
+    vf img_w = vf_set1((float)w);
+    vf img_h = vf_set1((float)h);
+    vf half = vf_set1(0.5f);
+    vf zero = vf_set1(0);
+    vf guard = vf_set1(CLIP_GUARD_BAND);
+
+    // Components of a batch after splitting the packed triples
+    float px[VERT_BATCH], py[VERT_BATCH], pz[VERT_BATCH];
+    float qx[VERT_BATCH], qy[VERT_BATCH], qz[VERT_BATCH];
+
+    for(; i + VERT_BATCH <= n; i += VERT_BATCH){
+
+        // Split the xyz triples of the batch into one array per component
+        for(int b = 0; b < VERT_BATCH; b++){
+            px[b] = pos[3*(i+b)];
+            py[b] = pos[3*(i+b)+1];
+            pz[b] = pos[3*(i+b)+2];
+        }
+        if(norm){
+            for(int b = 0; b < VERT_BATCH; b++){
+                qx[b] = norm[3*(i+b)];
+                qy[b] = norm[3*(i+b)+1];
+                qz[b] = norm[3*(i+b)+2];
+            }
+        }
+
+        size_t k = first + i;
+        for(int b = 0; b < VERT_BATCH; b += VF_WIDTH, k += VF_WIDTH){
+
+            vf x = vf_load(px + b), y = vf_load(py + b), z = vf_load(pz + b);
+
+            // Project (same order of sums as mat4 * vec4)
+            vf cx = vf_add(vf_add(vf_add(vf_mul(m[0][0], x), vf_mul(m[1][0], y)), vf_mul(m[2][0], z)), m[3][0]);
+            vf cy = vf_add(vf_add(vf_add(vf_mul(m[0][1], x), vf_mul(m[1][1], y)), vf_mul(m[2][1], z)), m[3][1]);
+            vf cz = vf_add(vf_add(vf_add(vf_mul(m[0][2], x), vf_mul(m[1][2], y)), vf_mul(m[2][2], z)), m[3][2]);
+            vf cw = vf_add(vf_add(vf_add(vf_mul(m[0][3], x), vf_mul(m[1][3], y)), vf_mul(m[2][3], z)), m[3][3]);
+
+            // Outcodes: one bit mask of the lanes per plane, spread back over the lanes
+            vf ncw = vf_sub(zero, cw);
+            vf gcw = vf_mul(guard, cw);
+            vf ngcw = vf_sub(zero, gcw);
+            int m_left = vf_movemask(vf_cmplt(cx, ncw));
+            int m_right = vf_movemask(vf_cmplt(cw, cx));
+            int m_bottom = vf_movemask(vf_cmplt(cy, ncw));
+            int m_top = vf_movemask(vf_cmplt(cw, cy));
+            int m_near = vf_movemask(vf_cmplt(cz, zero));
+            int m_far = vf_movemask(vf_cmplt(cw, cz));
+            int m_band = vf_movemask(vf_or(vf_or(vf_cmplt(cx, ngcw), vf_cmplt(gcw, cx)),
+                                           vf_or(vf_cmplt(cy, ngcw), vf_cmplt(gcw, cy))));
+            for(int l = 0; l < VF_WIDTH; l++){
+                out.clip[k + l] = (((m_left >> l) & 1) * CLIP_LEFT) | (((m_right >> l) & 1) * CLIP_RIGHT) |
+                                  (((m_bottom >> l) & 1) * CLIP_BOTTOM) | (((m_top >> l) & 1) * CLIP_TOP) |
+                                  (((m_near >> l) & 1) * CLIP_NEAR) | (((m_far >> l) & 1) * CLIP_FAR) |
+                                  (((m_band >> l) & 1) * CLIP_GUARD);
+            }
+
+            // Keep 1/w, convert to NDC and then to pixel coordinates
+            vf_store(&out.iw[k], vf_div(one, cw));
+            vf_store(&out.x[k], vf_mul(vf_mul(vf_add(vf_div(cx, cw), one), img_w), half));
+            vf_store(&out.y[k], vf_mul(vf_mul(vf_sub(one, vf_div(cy, cw)), img_h), half));
+            vf_store(&out.z[k], vf_div(cz, cw));
+
+            // Rotate the normals to the camera frame
+            if(norm){
+                x = vf_load(qx + b), y = vf_load(qy + b), z = vf_load(qz + b);
+                vf_store(&out.nx[k], vf_add(vf_add(vf_add(vf_mul(r[0][0], x), vf_mul(r[1][0], y)), vf_mul(r[2][0], z)), r[3][0]));
+                vf_store(&out.ny[k], vf_add(vf_add(vf_add(vf_mul(r[0][1], x), vf_mul(r[1][1], y)), vf_mul(r[2][1], z)), r[3][1]));
+                vf_store(&out.nz[k], vf_add(vf_add(vf_add(vf_mul(r[0][2], x), vf_mul(r[1][2], y)), vf_mul(r[2][2], z)), r[3][2]));
+            }
+            else{
+                vf_store(&out.nx[k], zero);
+                vf_store(&out.ny[k], zero);
+                vf_store(&out.nz[k], zero);
+            }
+        }
+    }
+#endif
+
+    // Vertices left over after the last full batch
+    for(; i < n; i++){
+        transform_one(pos + 3*i, norm ? (norm + 3*i) : NULL, cam, (float)w, (float)h, out, first + i);
+    }
+
+    // Snap to 1/16th of a pixel and use the snapped position for the interpolation as well,
+    // so that shared edges are covered exactly once and the attributes match the covered pixels
+    for(size_t k = first; k < first + n; k++){
+        out.s[k] = snap_pt(out.x[k], out.y[k]);
+        out.x[k] = (float)out.s[k].x / FX_ONE;
+        out.y[k] = (float)out.s[k].y / FX_ONE;
+    }
+}
+
+// Number of chunks of VERT_CHUNK vertices in a mesh
+static int mesh_chunks(mesh_view &mesh){
+    return (mesh.n_verts + VERT_CHUNK - 1) / VERT_CHUNK;
+}
+
+// Transform the vertices of all the meshes in chunks spread over the threads of the pool
+void transform_shapes(vector<vert_soa> &verts, vector<mesh_view> &meshes, cam_dat &cam, int w, int h,
+                      thread_pool &pool){
+
+    // Size the outputs up front so that the threads only write into them
+    verts.resize(meshes.size());
+    int n_chunks = 0;
+    for(unsigned int j = 0; j < meshes.size(); j++){
+        size_t n = meshes[j].n_verts;
+        vert_soa &v = verts[j];
+        v.x.resize(n);
+        v.y.resize(n);
+        v.z.resize(n);
+        v.iw.resize(n);
+        v.nx.resize(n);
+        v.ny.resize(n);
+        v.nz.resize(n);
+        v.s.resize(n);
+        v.clip.resize(n);
+        n_chunks += mesh_chunks(meshes[j]);
+    }
+
+    pool.run(n_chunks, [&](int c){
+
+        // Find the mesh that chunk c belongs to
+        unsigned int j = 0;
+        while(c >= mesh_chunks(meshes[j])){
+            c -= mesh_chunks(meshes[j]);
+            j++;
+        }
+        size_t first = (size_t)c * VERT_CHUNK;
+        mesh_view &mesh = meshes[j];
+        size_t n = min((size_t)VERT_CHUNK, mesh.n_verts - first);
+
+        transform_verts(mesh.positions + 3*first, mesh.normals ? (mesh.normals + 3*first) : NULL, n, cam, w, h, verts[j], first);
+    });
+}
@@ -0,0 +1,27 @@
+// Vertex processing stage. Vertices are read from packed xyz float streams and transformed
+// VERT_BATCH at a time with SIMD into the structure of arrays used to build the triangles.
+
+#ifndef VERTEX_STAGE_H
+#define VERTEX_STAGE_H
+
+#include "raster_tools.h"
+#include "thread_pool.h"
+
+/// Number of vertices transformed per iteration
+#define VERT_BATCH 8
+
+/// Number of vertices handed to a thread at a time
+#define VERT_CHUNK 4096
+
+/// Transform n vertices into out starting at vertex first.
+/// pos and norm point to n packed (x, y, z) triples. norm may be NULL, in which case the normals are set to 0.
+/// out must already hold at least first + n vertices.
+void transform_verts(const float *pos, const float *norm, size_t n, cam_dat &cam, int w, int h,
+                     vert_soa &out, size_t first);
+
+/// Transform the vertices of all the meshes in chunks spread over the threads of the pool.
+/// verts is resized to match the meshes, so repeated calls with the same meshes do not allocate.
+void transform_shapes(vector<vert_soa> &verts, vector<mesh_view> &meshes, cam_dat &cam, int w, int h,
+                      thread_pool &pool);
+
+#endif // VERTEX_STAGE_H